@@ -0,0 +1,113 @@
+// Copyright 2016 Dino Wernli. All Rights Reserved. See LICENSE for licensing terms.
+
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include <cassert>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+#include "error.h"
+#include "input.h"
+
+namespace ccproducers {
+
+// A read-only view of a contiguous range of values.
+template<class T>
+class Span {
+ public:
+  Span(const T* data, size_t size) : data_(data), size_(size) {}
+
+  const T* data() const { return data_; }
+  size_t size() const { return size_; }
+  const T& operator[](size_t i) const { return data_[i]; }
+  const T* begin() const { return data_; }
+  const T* end() const { return data_ + size_; }
+
+ private:
+  const T* data_;
+  size_t size_;
+};
+
+// A writable view of a contiguous range of values.
+template<class T>
+class MutableSpan {
+ public:
+  MutableSpan(T* data, size_t size) : data_(data), size_(size) {}
+
+  T* data() const { return data_; }
+  size_t size() const { return size_; }
+  T& operator[](size_t i) const { return data_[i]; }
+  T* begin() const { return data_; }
+  T* end() const { return data_ + size_; }
+
+ private:
+  T* data_;
+  size_t size_;
+};
+
+// Holds one value per request of a batch, in structure-of-arrays layout: the
+// values of all requests are contiguous, and each request separately either
+// has a value or an error. Requests with an error hold a default constructed
+// value, so T must be default constructible.
+template<class T>
+class Batch {
+ public:
+  static_assert(!std::is_same<T, bool>::value,
+                "std::vector<bool> is not contiguous, use char instead");
+
+  Batch(size_t size) : values_(size), errors_(size) {}
+  Batch(std::vector<T>&& values)
+      : values_(std::move(values)), errors_(values_.size()) {}
+
+  size_t size() const { return values_.size(); }
+
+  bool IsError(size_t i) const { return errors_[i] != nullptr; }
+
+  // This must only be called if IsError(i) returns false.
+  const T& get(size_t i) const {
+    assert(!IsError(i));
+    return values_[i];
+  }
+
+  // This must only be called if IsError(i) returns true.
+  const Error& error(size_t i) const {
+    assert(IsError(i));
+    return *errors_[i];
+  }
+
+  void Set(size_t i, T&& value) {
+    values_[i] = std::move(value);
+    errors_[i] = nullptr;
+  }
+
+  void SetError(size_t i, Error&& error) {
+    errors_[i] = std::make_unique<Error>(std::move(error));
+  }
+
+  // The values of all requests, including the placeholders of failed ones.
+  Span<T> values() const { return Span<T>(values_.data(), values_.size()); }
+  MutableSpan<T> mutable_values() {
+    return MutableSpan<T>(values_.data(), values_.size());
+  }
+
+  // Returns an Input instance which points to the result of request i.
+  Input<T> ElementInput(size_t i) const {
+    if (IsError(i)) {
+      return Input<T>(errors_[i].get());
+    } else {
+      return Input<T>(&values_[i]);
+    }
+  }
+
+ private:
+  std::vector<T> values_;
+
+  // Set for the requests which failed, nullptr otherwise.
+  std::vector<std::unique_ptr<Error>> errors_;
+};
+
+}  // namespace ccproducers
+
+#endif  // BATCH_H
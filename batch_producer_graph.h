@@ -0,0 +1,186 @@
+// Copyright 2016 Dino Wernli. All Rights Reserved. See LICENSE for licensing terms.
+
+#ifndef BATCH_PRODUCER_GRAPH_H_
+#define BATCH_PRODUCER_GRAPH_H_
+
+#include <cassert>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "batch.h"
+#include "error.h"
+#include "input.h"
+#include "node.h"
+#include "output.h"
+#include "producer_graph.h"
+
+namespace ccproducers {
+
+// A handle to a node which produces one value per request of a batch.
+template<class T>
+using BatchHandle = NodeHandle<Batch<T>>;
+
+// Evaluates the same graph topology for a whole batch of independent
+// requests at once. Every node runs once per batch rather than once per
+// request, so the scheduling cost of a node is shared by all requests.
+//
+// Producers either take single values, in which case they are called once
+// per request, or opt into a batch signature which operates on all requests
+// in a single call:
+//
+//   void Kernel(MutableSpan<R> output, Span<P1> p1, Span<P2> p2, ...);
+//
+// Batch producers see the values of all requests, including placeholders
+// for failed requests. Requests which failed in any input are marked as
+// failed in the output regardless of what the producer writes.
+class BatchProducerGraph {
+ public:
+  BatchProducerGraph(size_t batch_size) : batch_size_(batch_size) {}
+
+  size_t batch_size() const { return batch_size_; }
+
+  // The underlying graph, e.g., for attaching resource pools or metrics.
+  ProducerGraph* graph() { return &graph_; }
+
+  // Adds a node providing one value per request. The number of values must
+  // match the batch size.
+  template<typename T>
+  BatchHandle<T>* AddInput(std::string name, std::vector<T> values) {
+    assert(values.size() == batch_size_);
+    // Every run of the node, e.g., every hedged attempt, shares the batch
+    // rather than copying it.
+    auto batch = std::make_shared<const Batch<T>>(std::move(values));
+    std::function<Output<Batch<T>>()> producer = [batch]() {
+      return Output<Batch<T>>(batch);
+    };
+    return graph_.AddProducer<Batch<T>>(name, producer);
+  }
+
+  // Adds a producer which gets called once per request.
+  template<typename ReturnType, typename... Params>
+  BatchHandle<ReturnType>* AddProducer(
+      std::string name,
+      Output<ReturnType> (*f)(Input<Params>...),
+      BatchHandle<Params>*... inputs) {
+    std::function<Output<ReturnType>(Input<Params>...)> function(f);
+    return graph_.AddProducer<Batch<ReturnType>, Batch<Params>...>(
+        name, PerElement<ReturnType, Params...>(function), inputs...);
+  }
+
+  template<typename ReturnType, typename... Params>
+  BatchHandle<ReturnType>* AddProducer(
+      Output<ReturnType> (*f)(Input<Params>...),
+      BatchHandle<Params>*... inputs) {
+    return AddProducer("" /* name */, f, inputs...);
+  }
+
+  // Adds a producer which gets called once for the whole batch.
+  template<typename ReturnType, typename... Params>
+  BatchHandle<ReturnType>* AddBatchProducer(
+      std::string name,
+      void (*f)(MutableSpan<ReturnType>, Span<Params>...),
+      BatchHandle<Params>*... inputs) {
+    std::function<void(MutableSpan<ReturnType>, Span<Params>...)> function(f);
+    return graph_.AddProducer<Batch<ReturnType>, Batch<Params>...>(
+        name, Vectorized<ReturnType, Params...>(function), inputs...);
+  }
+
+  template<typename ReturnType, typename... Params>
+  BatchHandle<ReturnType>* AddBatchProducer(
+      void (*f)(MutableSpan<ReturnType>, Span<Params>...),
+      BatchHandle<Params>*... inputs) {
+    return AddBatchProducer("" /* name */, f, inputs...);
+  }
+
+  // Runs all the producers required to produce the supplied batch.
+  template<typename T>
+  std::future<const Batch<T>&> Execute(BatchHandle<T>* handle) {
+    return graph_.Execute(handle);
+  }
+
+  template<typename T>
+  std::future<std::shared_ptr<const Batch<T>>> ExecuteShared(BatchHandle<T>* handle) {
+    return graph_.ExecuteShared(handle);
+  }
+
+ private:
+  // Returns whether request i has failed in the supplied input.
+  template<typename T>
+  static bool ElementFailed(const Input<Batch<T>>& input, size_t i) {
+    return input.IsError() || input.get().IsError(i);
+  }
+
+  template<typename... Params>
+  static bool AnyElementFailed(size_t i, const Input<Batch<Params>>&... inputs) {
+    bool failed[] = {false, ElementFailed(inputs, i)...};
+    for (bool f : failed) {
+      if (f) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Turns a producer of single values into a producer of batches which loops
+  // over all requests.
+  template<typename ReturnType, typename... Params>
+  std::function<Output<Batch<ReturnType>>(Input<Batch<Params>>...)> PerElement(
+      std::function<Output<ReturnType>(Input<Params>...)> f) {
+    size_t size = batch_size_;
+    return [f, size](Input<Batch<Params>>... inputs) {
+      Batch<ReturnType> result(size);
+      for (size_t i = 0; i < size; ++i) {
+        if (AnyElementFailed(i, inputs...)) {
+          result.SetError(i, Error("Input failed"));
+          continue;
+        }
+        try {
+          Output<ReturnType> output = f(inputs.get().ElementInput(i)...);
+          if (output.IsError()) {
+            result.SetError(i, output.TakeError());
+          } else {
+            result.Set(i, output.TakeValue());
+          }
+        } catch (std::exception&) {
+          result.SetError(i, Error("Exception while running producer"));
+        }
+      }
+      return Output<Batch<ReturnType>>(std::move(result));
+    };
+  }
+
+  // Turns a batch producer into a producer of batches, taking care of
+  // propagating the failures of individual requests.
+  template<typename ReturnType, typename... Params>
+  std::function<Output<Batch<ReturnType>>(Input<Batch<Params>>...)> Vectorized(
+      std::function<void(MutableSpan<ReturnType>, Span<Params>...)> f) {
+    size_t size = batch_size_;
+    return [f, size](Input<Batch<Params>>... inputs) {
+      bool batch_failed[] = {false, inputs.IsError()...};
+      for (bool failed : batch_failed) {
+        if (failed) {
+          return Output<Batch<ReturnType>>(Error("Input batch failed"));
+        }
+      }
+
+      Batch<ReturnType> result(size);
+      f(result.mutable_values(), inputs.get().values()...);
+      for (size_t i = 0; i < size; ++i) {
+        if (AnyElementFailed(i, inputs...)) {
+          result.SetError(i, Error("Input failed"));
+        }
+      }
+      return Output<Batch<ReturnType>>(std::move(result));
+    };
+  }
+
+  size_t batch_size_;
+  ProducerGraph graph_;
+};
+
+}  // namespace ccproducers
+
+#endif  // BATCH_PRODUCER_GRAPH_H
@@ -0,0 +1,84 @@
+// Copyright 2016 Dino Wernli. All Rights Reserved. See LICENSE for licensing terms.
+
+#include "hedging.h"
+
+#include <algorithm>
+#include <assert.h>
+
+namespace {
+
+// Default process-wide cap on concurrently running hedged invocations.
+const int kDefaultGlobalMaxHedges = 64;
+
+}  // namespace
+
+namespace ccproducers {
+
+HedgeBudget* HedgeBudget::Global() {
+  static HedgeBudget* global = new HedgeBudget(kDefaultGlobalMaxHedges);
+  return global;
+}
+
+bool HedgeBudget::TryAcquire() {
+  int current = in_flight_.load();
+  while (current < max_in_flight_.load()) {
+    if (in_flight_.compare_exchange_weak(current, current + 1)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void HedgeBudget::Release() {
+  int previous = in_flight_--;
+  assert(previous > 0);
+}
+
+HedgingPolicy::HedgingPolicy(Duration delay) :
+    percentile_(-1), initial_delay_(delay), min_samples_(0), history_size_(0),
+    next_sample_(0), hedges_launched_(0), hedges_won_(0) {}
+
+HedgingPolicy::HedgingPolicy(
+    double percentile, Duration initial_delay, int min_samples, int history_size) :
+    percentile_(percentile), initial_delay_(initial_delay),
+    min_samples_(min_samples), history_size_(history_size), next_sample_(0),
+    hedges_launched_(0), hedges_won_(0) {
+  assert(percentile >= 0 && percentile <= 1);
+  assert(history_size > 0);
+}
+
+HedgingPolicy::Duration HedgingPolicy::HedgeDelay() const {
+  if (percentile_ < 0) {
+    return initial_delay_;
+  }
+
+  std::vector<Duration> samples;
+  {
+    std::lock_guard<std::mutex> lock(history_lock_);
+    if (history_.empty() || history_.size() < min_samples_) {
+      return initial_delay_;
+    }
+    samples = history_;
+  }
+
+  size_t index = std::min(
+      samples.size() - 1, static_cast<size_t>(percentile_ * samples.size()));
+  std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+  return samples[index];
+}
+
+void HedgingPolicy::RecordLatency(Duration latency) {
+  if (percentile_ < 0) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(history_lock_);
+  if (history_.size() < history_size_) {
+    history_.push_back(latency);
+  } else {
+    history_[next_sample_] = latency;
+    next_sample_ = (next_sample_ + 1) % history_size_;
+  }
+}
+
+}  // namespace ccproducers
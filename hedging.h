@@ -0,0 +1,94 @@
+// Copyright 2016 Dino Wernli. All Rights Reserved. See LICENSE for licensing terms.
+
+#ifndef HEDGING_H_
+#define HEDGING_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace ccproducers {
+
+// Caps the number of hedged (duplicate) producer invocations which may be in
+// flight at the same time. Used both per graph and process-wide so that
+// hedging cannot amplify load arbitrarily, e.g., when a backend is slow for
+// everyone during an incident.
+class HedgeBudget {
+ public:
+  HedgeBudget(int max_in_flight) : max_in_flight_(max_in_flight), in_flight_(0) {}
+
+  // The budget shared by all graphs in the process.
+  static HedgeBudget* Global();
+
+  void set_max_in_flight(int max_in_flight) { max_in_flight_ = max_in_flight; }
+  int in_flight() const { return in_flight_; }
+
+  // Returns true and takes one unit of budget if any is left.
+  bool TryAcquire();
+
+  // Returns a unit of budget previously taken by TryAcquire().
+  void Release();
+
+ private:
+  std::atomic<int> max_in_flight_;
+  std::atomic<int> in_flight_;
+};
+
+// An opt-in policy for idempotent producers with heavy latency tails. If a
+// run takes longer than the hedge delay, a duplicate invocation is started and
+// the first successful output wins. The hedge delay is either fixed or a
+// percentile of the latencies previously recorded by this policy.
+//
+// A policy is meant to be shared by all graphs registering the same producer,
+// so that the latency history spans many executions. It must outlive all the
+// graphs referencing it.
+class HedgingPolicy {
+ public:
+  typedef std::chrono::microseconds Duration;
+
+  // Hedges after a fixed delay.
+  HedgingPolicy(Duration delay);
+
+  // Hedges once a run takes longer than the supplied percentile (in [0, 1])
+  // of the recorded latencies. Uses initial_delay until min_samples
+  // latencies have been recorded. Only the latest history_size latencies are
+  // taken into account.
+  HedgingPolicy(
+      double percentile,
+      Duration initial_delay,
+      int min_samples = 20,
+      int history_size = 1000);
+
+  // Returns how long to wait for a run before starting a duplicate.
+  Duration HedgeDelay() const;
+
+  // Records the latency of a single producer invocation.
+  void RecordLatency(Duration latency);
+
+  void RecordHedgeLaunched() { ++hedges_launched_; }
+  void RecordHedgeWon() { ++hedges_won_; }
+
+  int64_t hedges_launched() const { return hedges_launched_; }
+  int64_t hedges_won() const { return hedges_won_; }
+
+ private:
+  // A negative percentile means the initial delay is used unconditionally.
+  double percentile_;
+  Duration initial_delay_;
+  size_t min_samples_;
+  size_t history_size_;
+
+  // Ring buffer of recent latencies, guarded by history_lock_.
+  mutable std::mutex history_lock_;
+  std::vector<Duration> history_;
+  size_t next_sample_;
+
+  std::atomic<int64_t> hedges_launched_;
+  std::atomic<int64_t> hedges_won_;
+};
+
+}  // namespace ccproducers
+
+#endif  // HEDGING_H
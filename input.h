@@ -13,7 +13,8 @@ namespace ccproducers {
 template<class T>
 class Input {
  public:
-  Input(const Value<T>* value) : value_(value), error_(nullptr) {}
+  Input(const Value<T>* value) : value_(&value->get()), error_(nullptr) {}
+  Input(const T* value) : value_(value), error_(nullptr) {}
   Input(const Error* error) : value_(nullptr), error_(error) {}
   Input(const Input<T>& other) : value_(other.value_), error_(other.error_) {}
   ~Input() {}
@@ -22,7 +23,7 @@ class Input {
     if (IsError()) {
       throw std::runtime_error("hi");
     }
-    return value_->get();
+    return *value_;
   }
 
   bool IsError() const {
@@ -35,7 +36,7 @@ class Input {
 
  private:
   // Exactly one of these fields are set (i.e., not nullptr).
-  const Value<T>* value_;
+  const T* value_;
   const Error* error_;
 };
 
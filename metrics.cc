@@ -0,0 +1,281 @@
+// Copyright 2016 Dino Wernli. All Rights Reserved. See LICENSE for licensing terms.
+
+#include "metrics.h"
+
+#include <algorithm>
+#include <sstream>
+
+namespace {
+
+const char* kMetricPrefix = "ccproducers_";
+
+// Returns the shard used by the calling thread. Threads are assigned shards
+// round-robin the first time they record anything.
+int ThreadShard() {
+  static std::atomic<int> next_shard(0);
+  thread_local int shard = next_shard++ % ccproducers::NodeMetrics::kNumShards;
+  return shard;
+}
+
+// Escapes a label value as required by the Prometheus text format.
+std::string EscapeLabel(const std::string& value) {
+  std::string result;
+  for (char c : value) {
+    if (c == '\\' || c == '"') {
+      result += '\\';
+      result += c;
+    } else if (c == '\n') {
+      result += "\\n";
+    } else {
+      result += c;
+    }
+  }
+  return result;
+}
+
+void WriteHistogram(
+    const std::string& name,
+    const std::string& labels,
+    const ccproducers::Histogram& histogram,
+    std::stringstream* stream) {
+  // Only emit the boundaries of non-empty buckets, the cumulative counts
+  // between those don't change.
+  uint64_t cumulative = 0;
+  for (int i = 0; i < ccproducers::Histogram::kNumBuckets; ++i) {
+    uint64_t count = histogram.BucketCount(i);
+    if (count == 0) {
+      continue;
+    }
+    cumulative += count;
+    *stream << name << "_bucket{" << labels << ",le=\""
+            << ccproducers::Histogram::BucketUpperBound(i) << "\"} "
+            << cumulative << "\n";
+  }
+  *stream << name << "_bucket{" << labels << ",le=\"+Inf\"} "
+          << histogram.count() << "\n";
+  *stream << name << "_sum{" << labels << "} " << histogram.sum() << "\n";
+  *stream << name << "_count{" << labels << "} " << histogram.count() << "\n";
+}
+
+}  // namespace
+
+namespace ccproducers {
+
+Histogram::Histogram() : count_(0), sum_(0) {
+  for (auto& bucket : buckets_) {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+}
+
+int Histogram::BucketFor(int64_t value) {
+  value = std::max<int64_t>(0, std::min<int64_t>(value, (1LL << kMaxValueBits) - 1));
+  if (value < kSubBuckets) {
+    return static_cast<int>(value);
+  }
+  int msb = 63 - __builtin_clzll(static_cast<uint64_t>(value));
+  int shift = msb - kSubBucketBits;
+  return (shift + 1) * kSubBuckets + static_cast<int>((value >> shift) & (kSubBuckets - 1));
+}
+
+int64_t Histogram::BucketUpperBound(int bucket) {
+  if (bucket < kSubBuckets) {
+    return bucket + 1;
+  }
+  int shift = bucket / kSubBuckets - 1;
+  int64_t lower = static_cast<int64_t>(kSubBuckets + bucket % kSubBuckets) << shift;
+  return lower + (1LL << shift);
+}
+
+void Histogram::Record(int64_t value) {
+  buckets_[BucketFor(value)].fetch_add(1, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+  sum_.fetch_add(std::max<int64_t>(0, value), std::memory_order_relaxed);
+}
+
+void Histogram::Merge(const Histogram& other) {
+  for (int i = 0; i < kNumBuckets; ++i) {
+    uint64_t count = other.BucketCount(i);
+    if (count != 0) {
+      buckets_[i].fetch_add(count, std::memory_order_relaxed);
+    }
+  }
+  count_.fetch_add(other.count(), std::memory_order_relaxed);
+  sum_.fetch_add(other.sum(), std::memory_order_relaxed);
+}
+
+int64_t Histogram::ValueAtPercentile(double percentile) const {
+  uint64_t total = count();
+  if (total == 0) {
+    return 0;
+  }
+  uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(percentile * total + 0.5));
+  uint64_t cumulative = 0;
+  for (int i = 0; i < kNumBuckets; ++i) {
+    cumulative += BucketCount(i);
+    if (cumulative >= rank) {
+      return BucketUpperBound(i);
+    }
+  }
+  return BucketUpperBound(kNumBuckets - 1);
+}
+
+NodeMetrics::Shard& NodeMetrics::LocalShard() {
+  return shards_[ThreadShard()];
+}
+
+void NodeMetrics::RecordRun(bool error) {
+  Shard& shard = LocalShard();
+  shard.runs.fetch_add(1, std::memory_order_relaxed);
+  if (error) {
+    shard.errors.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void NodeMetrics::RecordQueueWait(int64_t micros) {
+  LocalShard().queue_wait.Record(micros);
+}
+
+void NodeMetrics::RecordRunTime(int64_t micros) {
+  LocalShard().run_time.Record(micros);
+}
+
+uint64_t NodeMetrics::runs() const {
+  uint64_t result = 0;
+  for (const Shard& shard : shards_) {
+    result += shard.runs.load(std::memory_order_relaxed);
+  }
+  return result;
+}
+
+uint64_t NodeMetrics::errors() const {
+  uint64_t result = 0;
+  for (const Shard& shard : shards_) {
+    result += shard.errors.load(std::memory_order_relaxed);
+  }
+  return result;
+}
+
+void NodeMetrics::MergeQueueWait(Histogram* result) const {
+  for (const Shard& shard : shards_) {
+    result->Merge(shard.queue_wait);
+  }
+}
+
+void NodeMetrics::MergeRunTime(Histogram* result) const {
+  for (const Shard& shard : shards_) {
+    result->Merge(shard.run_time);
+  }
+}
+
+ExecutorMetrics::Shard& ExecutorMetrics::LocalShard() {
+  return shards_[ThreadShard()];
+}
+
+void ExecutorMetrics::AddQueueDepth(int64_t delta) {
+  LocalShard().queue_depth.fetch_add(delta, std::memory_order_relaxed);
+}
+
+void ExecutorMetrics::AddActiveWorkers(int64_t delta) {
+  LocalShard().active_workers.fetch_add(delta, std::memory_order_relaxed);
+}
+
+void ExecutorMetrics::RecordLaunch() {
+  LocalShard().launches.fetch_add(1, std::memory_order_relaxed);
+}
+
+void ExecutorMetrics::RecordSteal() {
+  LocalShard().steals.fetch_add(1, std::memory_order_relaxed);
+}
+
+int64_t ExecutorMetrics::queue_depth() const {
+  int64_t result = 0;
+  for (const Shard& shard : shards_) {
+    result += shard.queue_depth.load(std::memory_order_relaxed);
+  }
+  return result;
+}
+
+int64_t ExecutorMetrics::active_workers() const {
+  int64_t result = 0;
+  for (const Shard& shard : shards_) {
+    result += shard.active_workers.load(std::memory_order_relaxed);
+  }
+  return result;
+}
+
+uint64_t ExecutorMetrics::launches() const {
+  uint64_t result = 0;
+  for (const Shard& shard : shards_) {
+    result += shard.launches.load(std::memory_order_relaxed);
+  }
+  return result;
+}
+
+uint64_t ExecutorMetrics::steals() const {
+  uint64_t result = 0;
+  for (const Shard& shard : shards_) {
+    result += shard.steals.load(std::memory_order_relaxed);
+  }
+  return result;
+}
+
+MetricsRegistry::MetricsRegistry() : sampling_(false) {}
+
+NodeMetrics* MetricsRegistry::ForNode(const std::string& name) {
+  std::lock_guard<std::mutex> lock(nodes_lock_);
+  auto it = nodes_.find(name);
+  if (it == nodes_.end()) {
+    it = nodes_.emplace(name, std::make_unique<NodeMetrics>(&sampling_)).first;
+  }
+  return it->second.get();
+}
+
+std::string MetricsRegistry::ToPrometheusText() const {
+  std::string prefix(kMetricPrefix);
+  std::stringstream stream;
+
+  std::lock_guard<std::mutex> lock(nodes_lock_);
+  stream << "# TYPE " << prefix << "node_runs_total counter\n";
+  for (const auto& entry : nodes_) {
+    stream << prefix << "node_runs_total{node=\"" << EscapeLabel(entry.first)
+           << "\"} " << entry.second->runs() << "\n";
+  }
+  stream << "# TYPE " << prefix << "node_errors_total counter\n";
+  for (const auto& entry : nodes_) {
+    stream << prefix << "node_errors_total{node=\"" << EscapeLabel(entry.first)
+           << "\"} " << entry.second->errors() << "\n";
+  }
+
+  stream << "# TYPE " << prefix << "node_queue_wait_microseconds histogram\n";
+  for (const auto& entry : nodes_) {
+    Histogram merged;
+    entry.second->MergeQueueWait(&merged);
+    WriteHistogram(
+        prefix + "node_queue_wait_microseconds",
+        "node=\"" + EscapeLabel(entry.first) + "\"",
+        merged,
+        &stream);
+  }
+  stream << "# TYPE " << prefix << "node_run_time_microseconds histogram\n";
+  for (const auto& entry : nodes_) {
+    Histogram merged;
+    entry.second->MergeRunTime(&merged);
+    WriteHistogram(
+        prefix + "node_run_time_microseconds",
+        "node=\"" + EscapeLabel(entry.first) + "\"",
+        merged,
+        &stream);
+  }
+
+  stream << "# TYPE " << prefix << "executor_queue_depth gauge\n"
+         << prefix << "executor_queue_depth " << executor_.queue_depth() << "\n"
+         << "# TYPE " << prefix << "executor_active_workers gauge\n"
+         << prefix << "executor_active_workers " << executor_.active_workers() << "\n"
+         << "# TYPE " << prefix << "executor_launches_total counter\n"
+         << prefix << "executor_launches_total " << executor_.launches() << "\n"
+         << "# TYPE " << prefix << "executor_steals_total counter\n"
+         << prefix << "executor_steals_total " << executor_.steals() << "\n";
+  return stream.str();
+}
+
+}  // namespace ccproducers
@@ -0,0 +1,176 @@
+// Copyright 2016 Dino Wernli. All Rights Reserved. See LICENSE for licensing terms.
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace ccproducers {
+
+// A latency histogram with log-linear buckets in the style of HDR histograms:
+// every power of two is split into kSubBuckets equally sized buckets, which
+// bounds the relative error of any recorded value. Recording is lock-free and
+// histograms can be merged by adding up their buckets.
+class Histogram {
+ public:
+  // Number of buckets per power of two is 2^kSubBucketBits.
+  static const int kSubBucketBits = 3;
+  static const int kSubBuckets = 1 << kSubBucketBits;
+
+  // Values are clamped to [0, 2^kMaxValueBits).
+  static const int kMaxValueBits = 40;
+  static const int kNumBuckets =
+      (kMaxValueBits - kSubBucketBits + 1) * kSubBuckets;
+
+  Histogram();
+  Histogram(const Histogram&) = delete;
+  Histogram& operator=(const Histogram&) = delete;
+
+  void Record(int64_t value);
+
+  // Adds all the values recorded in other to this histogram.
+  void Merge(const Histogram& other);
+
+  uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+  uint64_t sum() const { return sum_.load(std::memory_order_relaxed); }
+  uint64_t BucketCount(int bucket) const {
+    return buckets_[bucket].load(std::memory_order_relaxed);
+  }
+
+  // Returns an upper bound for the supplied percentile (in [0, 1]) of the
+  // recorded values, or 0 if the histogram is empty.
+  int64_t ValueAtPercentile(double percentile) const;
+
+  static int BucketFor(int64_t value);
+
+  // All values v in the bucket satisfy v < BucketUpperBound(bucket).
+  static int64_t BucketUpperBound(int bucket);
+
+ private:
+  std::array<std::atomic<uint64_t>, kNumBuckets> buckets_;
+  std::atomic<uint64_t> count_;
+  std::atomic<uint64_t> sum_;
+};
+
+// Aggregated metrics for all nodes registered under the same name. Every
+// thread updates one of kNumShards shards, so that concurrently running
+// nodes don't contend on the same cache lines. Reads merge all shards.
+class NodeMetrics {
+ public:
+  static const int kNumShards = 8;
+
+  NodeMetrics(const std::atomic<bool>* sampling) : sampling_(sampling) {}
+
+  // Whether latencies should currently be recorded. If false, only the run
+  // and error counters are updated and no clocks are read.
+  bool Sampling() const { return sampling_->load(std::memory_order_relaxed); }
+
+  void RecordRun(bool error);
+  void RecordQueueWait(int64_t micros);
+  void RecordRunTime(int64_t micros);
+
+  uint64_t runs() const;
+  uint64_t errors() const;
+
+  // Merges the histograms of all shards into the supplied histogram.
+  void MergeQueueWait(Histogram* result) const;
+  void MergeRunTime(Histogram* result) const;
+
+ private:
+  struct Shard {
+    std::atomic<uint64_t> runs{0};
+    std::atomic<uint64_t> errors{0};
+    Histogram queue_wait;
+    Histogram run_time;
+
+    // Keeps the counters of the next shard off this shard's last cache line.
+    char padding[64];
+  };
+
+  Shard& LocalShard();
+
+  const std::atomic<bool>* sampling_;
+  std::array<Shard, kNumShards> shards_;
+};
+
+// Metrics of the mechanism used to launch node runs, shared by all graphs
+// reporting to the same registry. Sharded like NodeMetrics. The gauges are
+// kept as per-shard deltas, since a node may enter and leave a state on
+// different threads, and only add up to the actual value once merged.
+class ExecutorMetrics {
+ public:
+  static const int kNumShards = NodeMetrics::kNumShards;
+
+  void AddQueueDepth(int64_t delta);
+  void AddActiveWorkers(int64_t delta);
+  void RecordLaunch();
+  void RecordSteal();
+
+  // Nodes which are ready to run but have not been launched yet, e.g.,
+  // because they are waiting for capacity in a resource pool.
+  int64_t queue_depth() const;
+
+  // Nodes whose producer is currently running.
+  int64_t active_workers() const;
+
+  // Total number of node runs launched.
+  uint64_t launches() const;
+
+  // Total number of node runs taken over by an idle worker of a worker pool
+  // from the worker they were placed on.
+  uint64_t steals() const;
+
+ private:
+  struct Shard {
+    std::atomic<int64_t> queue_depth{0};
+    std::atomic<int64_t> active_workers{0};
+    std::atomic<uint64_t> launches{0};
+    std::atomic<uint64_t> steals{0};
+
+    // Keeps the counters of the next shard off this shard's cache line.
+    char padding[64];
+  };
+
+  Shard& LocalShard();
+
+  std::array<Shard, kNumShards> shards_;
+};
+
+// Collects runtime metrics of any number of graphs. Node metrics are
+// aggregated by node name, so graphs which register the same producers under
+// the same names share their metrics. The registry must outlive all graphs
+// which report to it.
+class MetricsRegistry {
+ public:
+  MetricsRegistry();
+
+  // Turns recording of latency histograms on or off. Off by default.
+  void set_sampling(bool sampling) { sampling_ = sampling; }
+
+  // Returns the metrics for the supplied node name, creating them if needed.
+  // The returned pointer stays valid for the lifetime of the registry.
+  NodeMetrics* ForNode(const std::string& name);
+
+  ExecutorMetrics* executor() { return &executor_; }
+
+  // Returns a snapshot of all metrics in the Prometheus text exposition
+  // format.
+  std::string ToPrometheusText() const;
+
+ private:
+  std::atomic<bool> sampling_;
+  ExecutorMetrics executor_;
+
+  mutable std::mutex nodes_lock_;
+  std::map<std::string, std::unique_ptr<NodeMetrics>> nodes_;
+};
+
+}  // namespace ccproducers
+
+#endif  // METRICS_H
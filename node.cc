@@ -3,14 +3,27 @@
 #include "node.h"
 
 #include <assert.h>
+#include <chrono>
+#include <memory>
 #include <set>
 #include <sstream>
 #include <string>
 
+namespace {
+
+int64_t MicrosSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start).count();
+}
+
+}  // namespace
+
 namespace ccproducers {
 
 NodeBase::NodeBase(int id, std::string name, std::set<NodeBase*> deps) :
-    id_(id), name_(name), deps_(deps), rdeps_({}), state_(NodeState::BLOCKED), finished_deps_({}) {
+    hedging_policy_(nullptr), hedge_budget_(nullptr), id_(id), name_(name),
+    resource_pool_(nullptr), resource_pool_slot_taken_(false), worker_pool_(nullptr), pinned_worker_(-1),
+    preferred_worker_(-1), worker_(-1), metrics_(nullptr), executor_metrics_(nullptr), launch_pending_(false), admission_(0), deps_(deps), rdeps_({}), state_(NodeState::BLOCKED), finished_deps_({}) {
   for (const auto& dep : deps) {
     dep->AddReverseDep(this);
   }
@@ -19,7 +32,36 @@ NodeBase::NodeBase(int id, std::string name, std::set<NodeBase*> deps) :
 void NodeBase::Run() {
   assert(!IsDone());
   assert(CanRun());
+
+  // Latencies are only measured while sampling, so that attaching metrics
+  // costs no more than a few relaxed atomic increments otherwise.
+  bool sampled = metrics_ != nullptr && metrics_->Sampling();
+  std::chrono::steady_clock::time_point start;
+  if (executor_metrics_ != nullptr) {
+    executor_metrics_->AddActiveWorkers(1);
+  }
+  if (sampled) {
+    start = std::chrono::steady_clock::now();
+    if (ready_time_ != std::chrono::steady_clock::time_point()) {
+      metrics_->RecordQueueWait(MicrosSince(ready_time_));
+    }
+  }
+
+  worker_ = WorkerPool::CurrentWorker();
   RunProducer();
+
+  if (metrics_ != nullptr) {
+    if (sampled) {
+      metrics_->RecordRunTime(MicrosSince(start));
+    }
+    metrics_->RecordRun(HasError());
+  }
+  if (executor_metrics_ != nullptr) {
+    executor_metrics_->AddActiveWorkers(-1);
+  }
+  if (resource_pool_ != nullptr && !resource_pool_slot_taken_) {
+    resource_pool_->Release();
+  }
   SetFinished();
 
   for (const auto& rdep : rdeps_) {
@@ -27,6 +69,25 @@ void NodeBase::Run() {
   }
 }
 
+void NodeBase::AwaitRun() {
+  std::unique_lock<std::mutex> lock(launch_lock_);
+  if (launch_pending_ && resource_pool_->Cancel(admission_)) {
+    std::cout << DebugPrefix() << "Withdrawing from resource pool: "
+              << resource_pool_->name() << std::endl;
+    launch_pending_ = false;
+    if (executor_metrics_ != nullptr) {
+      executor_metrics_->AddQueueDepth(-1);
+    }
+  }
+
+  // The pool may have handed this node its capacity already, in which case
+  // the launch is about to happen on another thread.
+  launched_.wait(lock, [this]() { return !launch_pending_; });
+  if (async_future_.valid()) {
+    async_future_.wait();
+  }
+}
+
 bool NodeBase::IsDone() const {
   std::lock_guard<std::recursive_mutex> lock(state_lock_);
   return (state_ == NodeState::FINISHED);
@@ -59,11 +120,74 @@ void NodeBase::Start() {
     return;
   }
 
-  std::cout << DebugPrefix() << "Kicking off async producer run" << std::endl;
-  async_future_ = std::async(std::launch::async, &NodeBase::Run, this);
+  if (executor_metrics_ != nullptr) {
+    executor_metrics_->AddQueueDepth(1);
+  }
+  if (metrics_ != nullptr && metrics_->Sampling()) {
+    ready_time_ = std::chrono::steady_clock::now();
+  }
+
+  if (resource_pool_ != nullptr) {
+    std::cout << DebugPrefix() << "Requesting admission to resource pool: "
+              << resource_pool_->name() << std::endl;
+    {
+      std::lock_guard<std::mutex> lock(launch_lock_);
+      launch_pending_ = true;
+    }
+    ResourcePool::Ticket ticket = resource_pool_->Admit([this]() { Launch(); });
+    std::lock_guard<std::mutex> lock(launch_lock_);
+    admission_ = ticket;
+  } else {
+    Launch();
+  }
   std::cout << DebugPrefix() << "Starting node finished" << std::endl;
 }
 
+void NodeBase::Launch() {
+  std::lock_guard<std::mutex> lock(launch_lock_);
+  launch_pending_ = false;
+  launched_.notify_all();
+  std::cout << DebugPrefix() << "Kicking off async producer run" << std::endl;
+  if (executor_metrics_ != nullptr) {
+    executor_metrics_->AddQueueDepth(-1);
+    executor_metrics_->RecordLaunch();
+  }
+  if (worker_pool_ == nullptr) {
+    async_future_ = std::async(std::launch::async, &NodeBase::Run, this);
+    return;
+  }
+
+  // The future must be in place before the run is queued, since the run may
+  // complete before Submit() returns.
+  auto done = std::make_shared<std::promise<void>>();
+  async_future_ = done->get_future();
+  int preferred_worker = PreferredWorker();
+  preferred_worker_ = preferred_worker;
+  worker_pool_->Submit(preferred_worker, pinned_worker_ >= 0, [this, done]() {
+    Run();
+    done->set_value();
+  });
+}
+
+int NodeBase::PreferredWorker() const {
+  if (pinned_worker_ >= 0) {
+    return pinned_worker_;
+  }
+
+  // Moving the consumer to the data is cheaper than the other way round, so
+  // follow the input with the most bytes.
+  int result = -1;
+  size_t largest = 0;
+  for (NodeBase* dep : deps_) {
+    size_t bytes = dep->OutputBytes();
+    if (dep->worker() >= 0 && (result < 0 || bytes > largest)) {
+      result = dep->worker();
+      largest = bytes;
+    }
+  }
+  return result;
+}
+
 void NodeBase::SetFinished() {
   std::lock_guard<std::recursive_mutex> lock(state_lock_);
   assert(state_ == NodeState::RUNNING);
@@ -95,6 +219,50 @@ void NodeBase::ReportFinished(NodeBase* node) {
   }
 }
 
+bool NodeBase::TryAcquireHedgeBudget() {
+  if (hedge_budget_ != nullptr && !hedge_budget_->TryAcquire()) {
+    return false;
+  }
+  if (!HedgeBudget::Global()->TryAcquire()) {
+    if (hedge_budget_ != nullptr) {
+      hedge_budget_->Release();
+    }
+    return false;
+  }
+
+  // A duplicate hits the same backend, so it needs capacity of its own.
+  if (resource_pool_ != nullptr && !resource_pool_->TryAcquire()) {
+    HedgeBudget::Global()->Release();
+    if (hedge_budget_ != nullptr) {
+      hedge_budget_->Release();
+    }
+    return false;
+  }
+  return true;
+}
+
+void NodeBase::ReleaseHedgeBudget() {
+  if (resource_pool_ != nullptr) {
+    resource_pool_->Release();
+  }
+  HedgeBudget::Global()->Release();
+  if (hedge_budget_ != nullptr) {
+    hedge_budget_->Release();
+  }
+}
+
+bool NodeBase::TakeResourcePoolSlot() {
+  if (resource_pool_ == nullptr) {
+    return false;
+  }
+  resource_pool_slot_taken_ = true;
+  return true;
+}
+
+void NodeBase::ReleaseResourcePoolSlot() {
+  resource_pool_->Release();
+}
+
 std::string NodeBase::DebugPrefix() const {
   std::stringstream stream;
   stream << "["
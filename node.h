@@ -3,14 +3,23 @@
 #ifndef NODE_H_
 #define NODE_H_
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <future>
 #include <iostream>
+#include <mutex>
 #include <set>
 #include <string>
+#include <vector>
 
 #include "error.h"
+#include "hedging.h"
 #include "input.h"
+#include "metrics.h"
 #include "output.h"
+#include "resource_pool.h"
+#include "worker_pool.h"
 
 namespace ccproducers {
 
@@ -47,11 +56,22 @@ class NodeHandle : public NodeHandleBase {
 class NodeBase {
  public:
   NodeBase(int id, std::string name, std::set<NodeBase*> deps);
+  virtual ~NodeBase() {}
 
   const std::string& name() const { return name_; }
 
+  // Whether this node consumes the outputs of other nodes.
+  bool HasDeps() const { return !deps_.empty(); }
+
   void Run();
   bool IsDone() const;
+
+  // Blocks until the async run of this node, if one was launched, has
+  // returned. A launch still queued in the node's resource pool is withdrawn,
+  // so the node will never run. Returns immediately if the node was never
+  // started.
+  void AwaitRun();
+
   void SetFinished();
   void AddReverseDep(NodeBase* rdep);
 
@@ -60,9 +80,47 @@ class NodeBase {
   bool TrySetRunning();
 
   // Starts the execution of this node asynchronously. Does not block.
-  // Eventually, this node's result promise will be fulfilled.
+  // Eventually, this node's result promise will be fulfilled. If the node
+  // belongs to a resource pool, the launch may be deferred until the pool has
+  // capacity.
   void Start();
 
+  // Tags this node with a resource pool which limits how many nodes of the
+  // pool run concurrently. Must be called before the graph is executed.
+  void SetResourcePool(ResourcePool* pool) { resource_pool_ = pool; }
+
+  // Makes this node report to the supplied metrics, either of which may be
+  // nullptr. Must be called before the graph is executed.
+  void SetMetrics(NodeMetrics* metrics, ExecutorMetrics* executor_metrics) {
+    metrics_ = metrics;
+    executor_metrics_ = executor_metrics;
+  }
+
+  // Makes this node run on the supplied worker pool rather than on a thread
+  // of its own. Must be called before the graph is executed.
+  void SetWorkerPool(WorkerPool* pool) { worker_pool_ = pool; }
+
+  // Makes this node run only on the supplied worker of its pool, regardless
+  // of where its inputs were produced. Must be called before the graph is
+  // executed.
+  void PinToWorker(int worker) { pinned_worker_ = worker; }
+
+  // The worker this node was placed on when launched, or -1 if the node was
+  // launched without a preference.
+  int preferred_worker() const { return preferred_worker_; }
+
+  // The worker this node ran on, or -1 if it did not run on a worker pool.
+  int worker() const { return worker_; }
+
+  // Enables hedging for this node, i.e., running a duplicate invocation of
+  // the producer if the first one is slow. Only valid for idempotent
+  // producers. Duplicates count against both the supplied graph budget and
+  // the global budget. Must be called before the graph is executed.
+  void SetHedgingPolicy(HedgingPolicy* policy, HedgeBudget* graph_budget) {
+    hedging_policy_ = policy;
+    hedge_budget_ = graph_budget;
+  }
+
   // Returns the transitive set of nodes which need to run in order for this
   // node to have produced a result. In particular, the returned set contains
   // this node.
@@ -78,21 +136,85 @@ class NodeBase {
 
  protected:
   virtual void RunProducer() = 0;
+
+  // Returns whether the producer has run and produced an error.
+  virtual bool HasError() const = 0;
+
+  // Returns the approximate size of the produced value, or 0 if there is
+  // none.
+  virtual size_t OutputBytes() const = 0;
   void TransitiveDepsInternal(std::set<NodeBase*>* result);
 
   std::string DebugPrefix() const;
   std::string DebugState() const;
 
+  // Tries to take one unit of the graph and the global hedge budget, as well
+  // as one unit of the node's resource pool, if any. Returns false, without
+  // holding anything, if any of them is exhausted.
+  bool TryAcquireHedgeBudget();
+  void ReleaseHedgeBudget();
+
+  // Hands the responsibility for releasing this node's resource pool slot
+  // from Run() to the caller. Returns false if the node has no pool.
+  bool TakeResourcePoolSlot();
+  void ReleaseResourcePoolSlot();
+
+  // Set if the producer of this node is hedged, nullptr otherwise.
+  HedgingPolicy* hedging_policy_;
+  HedgeBudget* hedge_budget_;
+
  private:
   bool CanRun() const;
 
+  // Kicks off the async run of this node. Must only be called once the node
+  // is RUNNING and has been admitted to its resource pool, if any.
+  void Launch();
+
+  // Picks the worker to run this node on: its pinned worker if any, else
+  // the worker which produced its largest input. Returns -1 if there is no
+  // preference.
+  int PreferredWorker() const;
+
   // The id of this node. Unique withing a producer graph.
   int id_;
   std::string name_;
 
+  // The pool this node's runs are admitted through. May be nullptr.
+  ResourcePool* resource_pool_;
+
+  // Set if the slot this node was admitted with is released by someone other
+  // than Run(), e.g., the last attempt of a hedged run.
+  bool resource_pool_slot_taken_;
+
+  // The pool this node runs on. If nullptr, each run gets its own thread.
+  WorkerPool* worker_pool_;
+  int pinned_worker_;
+
+  // Where this node was placed and where it ended up running. Atomic since
+  // they are read while other nodes of the graph are still running.
+  std::atomic<int> preferred_worker_;
+  std::atomic<int> worker_;
+
+  // Where this node reports metrics to, nullptr if it doesn't.
+  NodeMetrics* metrics_;
+  ExecutorMetrics* executor_metrics_;
+
+  // The time at which this node became ready to run. Only set if metrics
+  // were being sampled at the time.
+  std::chrono::steady_clock::time_point ready_time_;
+
   // Holds the future used to track the async producer run.
   std::future<void> async_future_;
 
+  // Set while the node waits for admission to its resource pool, i.e., from
+  // Start() until Launch() has populated async_future_. Guarded by
+  // launch_lock_, which also guards async_future_ against a launch from
+  // another graph's thread.
+  bool launch_pending_;
+  ResourcePool::Ticket admission_;
+  std::mutex launch_lock_;
+  std::condition_variable launched_;
+
   // Deps (need to run before) and rdeps (can only run after) of this node.
   // Don't need to be lock guarded because configuration happens before the
   // execution of the graph.
@@ -108,6 +230,23 @@ class NodeBase {
   mutable std::recursive_mutex finished_deps_lock_;
 };
 
+// Returns roughly how many bytes the supplied value occupies, including any
+// heap storage of common containers. Used to place consumers close to their
+// largest input.
+template<class T>
+size_t ApproximateBytes(const T& value) {
+  return sizeof(T);
+}
+
+inline size_t ApproximateBytes(const std::string& value) {
+  return sizeof(value) + value.size();
+}
+
+template<class T>
+size_t ApproximateBytes(const std::vector<T>& value) {
+  return sizeof(value) + value.size() * sizeof(T);
+}
+
 // Represents a node in the graph with an output of a specific type.
 template<class T>
 class Node : public NodeBase {
@@ -125,6 +264,22 @@ class Node : public NodeBase {
     return result_promise_.get_future();
   }
 
+  // Like ResultFuture(), but the future resolves to a handle which owns the
+  // result. The handle keeps only this node's value alive, so the graph may
+  // be destroyed while the handle is still in use.
+  std::future<std::shared_ptr<const T>> SharedResultFuture() {
+    return shared_result_promise_.get_future();
+  }
+
+  // Makes this node try load before running its producer, and hand any
+  // value it produces to store. Must be called before the graph is executed.
+  void SetCache(
+      std::function<std::shared_ptr<const T>()> load,
+      std::function<void(const T&)> store) {
+    cache_load_ = load;
+    cache_store_ = store;
+  }
+
   // Returns nullptr until the producer of this node hass been executed.
   const Output<T>* GetOutput() {
     return result_.get();
@@ -134,12 +289,19 @@ class Node : public NodeBase {
   void RunProducer() {
     std::cout << DebugPrefix() << "Running producer" << std::endl;
 
-    // Try running the producer, making sure we recover from any exceptions.
-    try {
-      result_ = std::make_unique<Output<T>>(std::move(producer_()));
-    } catch (std::exception&) {
-      result_ = std::make_unique<Output<T>>(
-          Error("Exception while running producer"));
+    if (cache_load_) {
+      result_ = LoadCachedOutput();
+    }
+
+    if (result_ == nullptr) {
+      if (hedging_policy_ != nullptr) {
+        result_ = RunHedged();
+      } else {
+        result_ = RunOnce();
+      }
+      if (cache_store_ && result_->IsValue()) {
+        StoreCachedOutput();
+      }
     }
 
     // Resolve the promise for the produced result.
@@ -148,17 +310,148 @@ class Node : public NodeBase {
         throw std::runtime_error("Producer ran and produced an error");
       } else {
         result_promise_.set_value(result_->get());
+        shared_result_promise_.set_value(result_->Share());
       }
     } catch (std::exception&) {
       std::cout << DebugPrefix()
                 << "Recovering from exception, setting failed" << std::endl;
       result_promise_.set_exception(std::current_exception());
+      shared_result_promise_.set_exception(std::current_exception());
     }
 
     std::cout << DebugPrefix() << "Running producer finished" << std::endl;
   }
 
+  bool HasError() const {
+    return result_ != nullptr && result_->IsError();
+  }
+
+  size_t OutputBytes() const {
+    if (result_ == nullptr || result_->IsError()) {
+      return 0;
+    }
+    return ApproximateBytes(result_->get());
+  }
+
  private:
+  // Shared between the attempts of a hedged run. Attempts may outlive the
+  // run if they lose, so this is reference counted.
+  struct HedgedRun {
+    std::mutex lock;
+    std::condition_variable done;
+    int outstanding = 0;
+
+    // Whether the run holds the node's pool slot, to be released by the
+    // last attempt to finish.
+    bool holds_pool_slot = false;
+    std::unique_ptr<Output<T>> winner;
+    std::unique_ptr<Output<T>> failure;
+  };
+
+  // Returns the output stored in the cache, or nullptr if there is none. A
+  // value which fails to load is treated like a missing one.
+  std::unique_ptr<Output<T>> LoadCachedOutput() {
+    try {
+      std::shared_ptr<const T> cached = cache_load_();
+      if (cached != nullptr) {
+        std::cout << DebugPrefix() << "Serving output from cache" << std::endl;
+        return std::make_unique<Output<T>>(std::move(cached));
+      }
+    } catch (std::exception&) {
+      std::cout << DebugPrefix() << "Unable to load output from cache" << std::endl;
+    }
+    return nullptr;
+  }
+
+  // Stores the produced output in the cache. Failing to do so only costs a
+  // later cache miss, so the output is kept either way.
+  void StoreCachedOutput() {
+    try {
+      cache_store_(result_->get());
+    } catch (std::exception&) {
+      std::cout << DebugPrefix() << "Unable to store output in cache" << std::endl;
+    }
+  }
+
+  // Runs the producer once, making sure we recover from any exceptions.
+  std::unique_ptr<Output<T>> RunOnce() {
+    try {
+      return std::make_unique<Output<T>>(std::move(producer_()));
+    } catch (std::exception&) {
+      return std::make_unique<Output<T>>(
+          Error("Exception while running producer"));
+    }
+  }
+
+  // Runs a single attempt of a hedged run and reports back to the run.
+  void RunAttempt(std::shared_ptr<HedgedRun> run, bool is_hedge) {
+    auto start = std::chrono::steady_clock::now();
+    std::unique_ptr<Output<T>> output = RunOnce();
+    hedging_policy_->RecordLatency(
+        std::chrono::duration_cast<HedgingPolicy::Duration>(
+            std::chrono::steady_clock::now() - start));
+    if (is_hedge) {
+      ReleaseHedgeBudget();
+    }
+
+    bool release_pool_slot;
+    {
+      std::lock_guard<std::mutex> lock(run->lock);
+      if (output->IsValue() && run->winner == nullptr) {
+        run->winner = std::move(output);
+        if (is_hedge) {
+          hedging_policy_->RecordHedgeWon();
+        }
+      } else if (output->IsError() && run->failure == nullptr) {
+        run->failure = std::move(output);
+      }
+      --run->outstanding;
+      release_pool_slot = run->outstanding == 0 && run->holds_pool_slot;
+      run->done.notify_all();
+    }
+
+    // A losing attempt still calls the backend, so the node's slot is only
+    // given back once no attempt is running anymore.
+    if (release_pool_slot) {
+      ReleaseResourcePoolSlot();
+    }
+  }
+
+  // Runs the producer, starting a duplicate invocation if the first one takes
+  // longer than the policy's hedge delay. Returns the first successful output,
+  // or an error if all attempts failed. A losing attempt keeps running in the
+  // background and its output is discarded.
+  std::unique_ptr<Output<T>> RunHedged() {
+    auto run = std::make_shared<HedgedRun>();
+    auto finished = [run]() {
+      return run->winner != nullptr || run->outstanding == 0;
+    };
+
+    std::unique_lock<std::mutex> lock(run->lock);
+    run->outstanding = 1;
+    run->holds_pool_slot = TakeResourcePoolSlot();
+    attempt_futures_.push_back(std::async(
+        std::launch::async, &Node<T>::RunAttempt, this, run, false));
+
+    if (!run->done.wait_for(lock, hedging_policy_->HedgeDelay(), finished)) {
+      if (TryAcquireHedgeBudget()) {
+        std::cout << DebugPrefix() << "Starting hedged attempt" << std::endl;
+        hedging_policy_->RecordHedgeLaunched();
+        ++run->outstanding;
+        attempt_futures_.push_back(std::async(
+            std::launch::async, &Node<T>::RunAttempt, this, run, true));
+      } else {
+        std::cout << DebugPrefix() << "No budget or capacity for hedging" << std::endl;
+      }
+    }
+    run->done.wait(lock, finished);
+
+    if (run->winner != nullptr) {
+      return std::move(run->winner);
+    }
+    return std::move(run->failure);
+  }
+
   // This points to nullptr until RunProducer() is called.
   std::unique_ptr<Output<T>> result_;
 
@@ -166,9 +459,21 @@ class Node : public NodeBase {
   // must only be executed if all dependency producers have already been run.
   std::function<Output<T>()> producer_;
 
+  // Set if the output of this node is cached, empty otherwise.
+  std::function<std::shared_ptr<const T>()> cache_load_;
+  std::function<void(const T&)> cache_store_;
+
   // A promise for the result. This is resolved once the result_ field above
   // gets populated with a value or an error.
   std::promise<const T&> result_promise_;
+
+  // Resolved alongside result_promise_, but hands out shared ownership of the
+  // value rather than a reference into this node.
+  std::promise<std::shared_ptr<const T>> shared_result_promise_;
+
+  // Futures of the attempts of a hedged run. Declared last so that destroying
+  // the node first waits for any losing attempt which is still running.
+  std::vector<std::future<void>> attempt_futures_;
 };
 
 }  // namespace ccproducers
@@ -3,10 +3,11 @@
 #ifndef OUTPUT_H_
 #define OUTPUT_H_
 
+#include <cassert>
 #include <memory>
 
 #include "error.h"
-#include "value.h"
+#include "input.h"
 
 namespace ccproducers {
 
@@ -19,19 +20,30 @@ template<class T>
 class Output : public OutputBase {
  public:
   Output(T&& content)
-      : value_(std::make_unique<Value<T>>(std::move(content))),
-        error_(nullptr) {}
+      : value_(std::make_shared<T>(std::move(content))),
+        error_(nullptr),
+        owns_value_(true) {}
+
+  // Creates an output for a value whose storage is owned elsewhere, e.g., by
+  // a memory mapping. The supplied pointer keeps that storage alive.
+  Output(std::shared_ptr<const T> value)
+      : value_(std::move(value)),
+        error_(nullptr),
+        owns_value_(false) {}
   Output(Error&& error)
       : value_(nullptr),
-        error_(std::make_unique<Error>(std::move(error))) {}
+        error_(std::make_unique<Error>(std::move(error))),
+        owns_value_(false) {}
   Output(Output<T>&& other)
       : value_(std::move(other.value_)),
-        error_(std::move(other.error_)) {}
+        error_(std::move(other.error_)),
+        owns_value_(other.owns_value_) {}
   ~Output() {}
 
   Output<T>& operator=(Output<T>&& other) {
     value_ = std::move(other.value_);
     error_ = std::move(other.error_);
+    owns_value_ = other.owns_value_;
     return *this;
   }
 
@@ -46,7 +58,35 @@ class Output : public OutputBase {
   // This must only be called if IsValue() returns true.
   const T& get() const {
     assert(IsValue());
-    return value_->get();
+    return *value_;
+  }
+
+  // Returns a handle which shares ownership of the value with this output,
+  // i.e., the value stays alive as long as the handle does, even if this
+  // output is destroyed. This must only be called if IsValue() returns true.
+  std::shared_ptr<const T> Share() const {
+    assert(IsValue());
+    return value_;
+  }
+
+  // Moves the value out of this output, which must not be used afterwards.
+  // Falls back to a copy if the value is shared, e.g., through Share(), or
+  // its storage is owned elsewhere. This must only be called if IsValue()
+  // returns true.
+  T TakeValue() {
+    assert(IsValue());
+    if (owns_value_ && value_.use_count() == 1) {
+      // The value was created non-const by this output.
+      return std::move(const_cast<T&>(*value_));
+    }
+    return T(*value_);
+  }
+
+  // Moves the error out of this output, which must not be used afterwards.
+  // This must only be called if IsError() returns true.
+  Error TakeError() {
+    assert(IsError());
+    return std::move(*error_);
   }
 
   // Returns an Input instance which points to the result of this output.
@@ -59,9 +99,13 @@ class Output : public OutputBase {
   }
 
  private:
-  // Exactly one of these two fields is set for any given instance.
-  std::unique_ptr<Value<T>> value_;
+  // Exactly one of these two fields is set for any given instance. The value
+  // is shared so that handles returned by Share() can outlive this output.
+  std::shared_ptr<const T> value_;
   std::unique_ptr<Error> error_;
+
+  // Whether value_ was allocated by this output rather than handed in.
+  bool owns_value_;
 };
 
 }  // namespace ccproducers
@@ -0,0 +1,330 @@
+// Copyright 2016 Dino Wernli. All Rights Reserved. See LICENSE for licensing terms.
+
+#include "persistent_cache.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+const char kFileMagic[8] = {'C', 'C', 'P', 'C', 'A', 'C', 'H', 'E'};
+const uint32_t kEntryMagic = 0x43434345;
+
+// Bumped whenever the layout below changes.
+const uint32_t kFormatVersion = 2;
+
+// Entries and the values within them start at offsets which are multiples of
+// this, so that zero copy values are suitably aligned within the mapping.
+const uint64_t kAlignment = alignof(std::max_align_t);
+
+struct FileHeader {
+  char magic[8];
+  uint32_t format_version;
+  uint32_t version;
+  uint64_t reserved[2];
+};
+
+// Followed by the key, padding, the value and padding.
+struct EntryHeader {
+  uint32_t magic;
+  uint32_t key_size;
+  uint64_t value_size;
+  uint64_t checksum;
+  uint64_t reserved;
+};
+
+static_assert(sizeof(FileHeader) % kAlignment == 0, "Misaligned file header");
+static_assert(sizeof(EntryHeader) % kAlignment == 0, "Misaligned entry header");
+
+uint64_t Align(uint64_t offset) {
+  return (offset + kAlignment - 1) / kAlignment * kAlignment;
+}
+
+// Owns a read-only mapping of a file. Values served from the mapping hold on
+// to it through an aliasing shared_ptr.
+class Mapping {
+ public:
+  Mapping(void* address, size_t length) : address_(address), length_(length) {}
+  ~Mapping() { munmap(address_, length_); }
+
+  const char* data() const { return static_cast<const char*>(address_); }
+
+ private:
+  void* address_;
+  size_t length_;
+};
+
+void PrintError(const std::string& path, const std::string& message) {
+  std::cout << "[persistent_cache=" << path << "] " << message << ": "
+            << std::strerror(errno) << std::endl;
+}
+
+// Where the parts of an entry start within the file.
+struct EntryBounds {
+  uint64_t key_offset;
+  uint64_t value_offset;
+  uint64_t next_offset;
+};
+
+// Computes the bounds of the supplied entry, which starts at the supplied
+// offset. The sizes in the header come from the file and may be anything, so
+// this returns false unless the entry lies entirely within the file.
+bool GetEntryBounds(
+    const EntryHeader& entry, uint64_t offset, uint64_t file_size, EntryBounds* bounds) {
+  if (entry.magic != kEntryMagic ||
+      offset > file_size || sizeof(EntryHeader) > file_size - offset) {
+    return false;
+  }
+  bounds->key_offset = offset + sizeof(EntryHeader);
+  if (entry.key_size > file_size - bounds->key_offset) {
+    return false;
+  }
+  bounds->value_offset = Align(bounds->key_offset + entry.key_size);
+  if (bounds->value_offset > file_size ||
+      entry.value_size > file_size - bounds->value_offset) {
+    return false;
+  }
+  bounds->next_offset = Align(bounds->value_offset + entry.value_size);
+  return bounds->next_offset <= file_size && bounds->next_offset > offset;
+}
+
+// Extends an FNV-1a hash by the supplied bytes.
+uint64_t Fnv1a(uint64_t hash, const char* data, size_t size) {
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ static_cast<unsigned char>(data[i])) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Stored with every entry to detect damaged keys and values.
+uint64_t Checksum(const char* key, size_t key_size, const char* value, size_t value_size) {
+  return Fnv1a(Fnv1a(14695981039346656037ULL, key, key_size), value, value_size);
+}
+
+// Holds an exclusive lock on a file for as long as it lives. Used to keep
+// processes sharing a cache file from interleaving their changes to it.
+class FileLock {
+ public:
+  FileLock(int fd) : fd_(fd) {
+    while (flock(fd_, LOCK_EX) != 0 && errno == EINTR) {}
+  }
+  ~FileLock() { flock(fd_, LOCK_UN); }
+
+ private:
+  int fd_;
+};
+
+}  // namespace
+
+namespace ccproducers {
+
+PersistentCache::PersistentCache(std::string path, uint32_t version) :
+    path_(path), version_(version), lock_fd_(-1), fd_(-1), end_offset_(0),
+    hits_(0), misses_(0) {
+  Open();
+}
+
+PersistentCache::~PersistentCache() {
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+  if (lock_fd_ >= 0) {
+    close(lock_fd_);
+  }
+}
+
+void PersistentCache::Open() {
+  lock_fd_ = open((path_ + ".lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (lock_fd_ < 0) {
+    PrintError(path_, "Unable to open cache lock file");
+    return;
+  }
+  FileLock file_lock(lock_fd_);
+
+  fd_ = open(path_.c_str(), O_RDWR | O_CLOEXEC);
+  if (fd_ < 0 && errno != ENOENT) {
+    PrintError(path_, "Unable to open cache file");
+    return;
+  }
+  if (fd_ < 0 || !Load()) {
+    Replace();
+  }
+}
+
+bool PersistentCache::Load() {
+  struct stat file_stat;
+  if (fstat(fd_, &file_stat) != 0) {
+    PrintError(path_, "Unable to stat cache file");
+    close(fd_);
+    fd_ = -1;
+    return true;
+  }
+  uint64_t file_size = file_stat.st_size;
+  if (file_size < sizeof(FileHeader)) {
+    return false;
+  }
+
+  void* address = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd_, 0);
+  if (address == MAP_FAILED) {
+    PrintError(path_, "Unable to map cache file");
+    close(fd_);
+    fd_ = -1;
+    return true;
+  }
+  auto mapping = std::make_shared<Mapping>(address, file_size);
+  const char* data = mapping->data();
+
+  FileHeader header;
+  std::memcpy(&header, data, sizeof(header));
+  if (std::memcmp(header.magic, kFileMagic, sizeof(kFileMagic)) != 0 ||
+      header.format_version != kFormatVersion ||
+      header.version != version_) {
+    return Discard("Discarding cache with mismatching version");
+  }
+
+  // Index all entries. Anything which is not a valid entry, including the
+  // remainder of an interrupted write, means the file can't be trusted.
+  uint64_t offset = sizeof(FileHeader);
+  while (offset < file_size) {
+    EntryHeader entry;
+    EntryBounds bounds;
+    if (file_size - offset < sizeof(entry)) {
+      return Discard("Discarding corrupt cache");
+    }
+    std::memcpy(&entry, data + offset, sizeof(entry));
+    if (!GetEntryBounds(entry, offset, file_size, &bounds) ||
+        entry.checksum != Checksum(data + bounds.key_offset, entry.key_size,
+                                   data + bounds.value_offset, entry.value_size)) {
+      return Discard("Discarding corrupt cache");
+    }
+
+    std::string key(data + bounds.key_offset, entry.key_size);
+    Entry cached{
+        std::shared_ptr<const char>(mapping, data + bounds.value_offset),
+        static_cast<size_t>(entry.value_size)};
+    entries_.emplace(std::move(key), std::move(cached));
+    offset = bounds.next_offset;
+  }
+  end_offset_ = offset;
+  std::cout << "[persistent_cache=" << path_ << "] "
+            << "Loaded " << entries_.size() << " entries" << std::endl;
+  return true;
+}
+
+bool PersistentCache::Discard(const std::string& reason) {
+  std::cout << "[persistent_cache=" << path_ << "] " << reason << std::endl;
+  entries_.clear();
+  return false;
+}
+
+void PersistentCache::Replace() {
+  FileHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, kFileMagic, sizeof(kFileMagic));
+  header.format_version = kFormatVersion;
+  header.version = version_;
+
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+
+  // Other processes may still serve values from a mapping of the current
+  // file, so it must never shrink. Renaming a new file over it leaves their
+  // mappings intact.
+  std::string temp_path = path_ + ".tmp." + std::to_string(getpid());
+  int fd = open(temp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    PrintError(path_, "Unable to create cache file");
+    return;
+  }
+  if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      rename(temp_path.c_str(), path_.c_str()) != 0) {
+    PrintError(path_, "Unable to reset cache file");
+    close(fd);
+    unlink(temp_path.c_str());
+    return;
+  }
+  fd_ = fd;
+  end_offset_ = sizeof(header);
+}
+
+uint64_t PersistentCache::FindEnd(uint64_t offset) {
+  struct stat file_stat;
+  if (fstat(fd_, &file_stat) != 0) {
+    return offset;
+  }
+  uint64_t file_size = file_stat.st_size;
+  while (offset < file_size) {
+    EntryHeader entry;
+    EntryBounds bounds;
+    if (pread(fd_, &entry, sizeof(entry), offset) != sizeof(entry) ||
+        !GetEntryBounds(entry, offset, file_size, &bounds)) {
+      break;
+    }
+    offset = bounds.next_offset;
+  }
+  return offset;
+}
+
+std::shared_ptr<const char> PersistentCache::Lookup(
+    const std::string& key, size_t* size) {
+  std::lock_guard<std::mutex> lock(lock_);
+  auto it = entries_.find(key);
+  if (it == entries_.end()) {
+    ++misses_;
+    return nullptr;
+  }
+  ++hits_;
+  *size = it->second.size;
+  return it->second.data;
+}
+
+void PersistentCache::Store(const std::string& key, const char* data, size_t size) {
+  // Keep an aligned copy in memory so that this process can serve it too.
+  size_t words = (size + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t);
+  std::shared_ptr<std::max_align_t> storage(
+      new std::max_align_t[words], std::default_delete<std::max_align_t[]>());
+  std::memcpy(storage.get(), data, size);
+  Entry entry{
+      std::shared_ptr<const char>(storage, reinterpret_cast<const char*>(storage.get())),
+      size};
+
+  std::lock_guard<std::mutex> lock(lock_);
+  if (!entries_.emplace(key, std::move(entry)).second || fd_ < 0) {
+    return;
+  }
+
+  EntryHeader header;
+  header.magic = kEntryMagic;
+  header.key_size = static_cast<uint32_t>(key.size());
+  header.value_size = size;
+  header.checksum = Checksum(key.data(), key.size(), data, size);
+  header.reserved = 0;
+  uint64_t value_offset = Align(sizeof(EntryHeader) + key.size());
+  std::vector<char> buffer(Align(value_offset + size), 0);
+  std::memcpy(buffer.data(), &header, sizeof(header));
+  std::memcpy(buffer.data() + sizeof(header), key.data(), key.size());
+  std::memcpy(buffer.data() + value_offset, data, size);
+
+  // Other processes may have appended since this one last did.
+  FileLock file_lock(lock_fd_);
+  end_offset_ = FindEnd(end_offset_);
+  ssize_t written = pwrite(fd_, buffer.data(), buffer.size(), end_offset_);
+  if (written != static_cast<ssize_t>(buffer.size())) {
+    // A partial entry is overwritten by the next successful store of any
+    // process. Should none follow, the file is discarded when next opened.
+    PrintError(path_, "Unable to append cache entry");
+    return;
+  }
+  end_offset_ += buffer.size();
+}
+
+}  // namespace ccproducers
@@ -0,0 +1,167 @@
+// Copyright 2016 Dino Wernli. All Rights Reserved. See LICENSE for licensing terms.
+
+#ifndef PERSISTENT_CACHE_H_
+#define PERSISTENT_CACHE_H_
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "serializer.h"
+
+namespace ccproducers {
+
+// A cache of producer outputs which survives process restarts. Entries live
+// in a single append-only file which is memory-mapped when the cache is
+// opened, so values of zero copy types are served straight from the mapping.
+//
+// Entries written by the current process are kept in memory and become part
+// of the mapping the next time the cache is opened. The file is stamped with
+// a user supplied version; opening it with a different version discards all
+// entries, as does detecting a corrupt file. Every entry carries a checksum,
+// and sizes read from the file are checked against its length, so a damaged
+// file is never read past its end.
+//
+// Several processes may use the same file at once, e.g., during a rolling
+// deploy. Appends are serialized through a lock file next to the cache file.
+// The file is never truncated or rewritten in place, since other processes
+// may be serving values from their mapping of it. Discarding entries instead
+// renames a fresh file into place, so that processes still holding the old
+// file keep using it, and their new entries are lost.
+class PersistentCache {
+ public:
+  PersistentCache(std::string path, uint32_t version);
+  ~PersistentCache();
+
+  PersistentCache(const PersistentCache&) = delete;
+  PersistentCache& operator=(const PersistentCache&) = delete;
+
+  // Returns the bytes stored for the supplied key, or nullptr if there are
+  // none. The returned data is aligned to alignof(std::max_align_t) and stays
+  // valid for as long as the returned pointer is held, even if the cache is
+  // destroyed in the meantime.
+  std::shared_ptr<const char> Lookup(const std::string& key, size_t* size);
+
+  // Stores the supplied bytes under the supplied key, both in memory and in
+  // the file. Storing a key twice keeps the first value.
+  void Store(const std::string& key, const char* data, size_t size);
+
+  int64_t hits() const { return hits_; }
+  int64_t misses() const { return misses_; }
+
+ private:
+  struct Entry {
+    std::shared_ptr<const char> data;
+    size_t size;
+  };
+
+  // Maps the file and indexes its entries. Replaces the file if it is
+  // missing, has the wrong version or is corrupt.
+  void Open();
+
+  // Maps and indexes the open file. Returns false if the file has to be
+  // replaced.
+  bool Load();
+
+  // Logs the supplied reason and drops any entries indexed so far. Returns
+  // false so that Load() can return its result.
+  bool Discard(const std::string& reason);
+
+  // Atomically replaces the file with an empty cache of the current version.
+  void Replace();
+
+  // Returns the end of the last valid entry at or after the supplied offset,
+  // which must be the start of an entry. Only headers are checked, since
+  // entries are complete once their writer releases the lock file.
+  uint64_t FindEnd(uint64_t offset);
+
+  std::string path_;
+  uint32_t version_;
+
+  // Locked while opening the cache and while appending to the file.
+  int lock_fd_;
+
+  // The file descriptor, or -1 if the cache could not be opened. In the
+  // latter case all lookups miss and stores only go to memory.
+  int fd_;
+
+  // Offset in the file at which the next entry is appended.
+  uint64_t end_offset_;
+
+  std::atomic<int64_t> hits_;
+  std::atomic<int64_t> misses_;
+
+  // Guards the fields below as well as appending to the file.
+  std::mutex lock_;
+  std::unordered_map<std::string, Entry> entries_;
+};
+
+// Returns the cached value for the supplied key, or nullptr on a miss. Zero
+// copy values point directly into the cache's storage, other types are
+// decoded by their Serializer.
+template<class T>
+std::shared_ptr<const T> LoadFromCache(PersistentCache* cache, const std::string& key);
+
+// Stores a value in the cache, using its Serializer unless T is zero copy.
+template<class T>
+void StoreInCache(PersistentCache* cache, const std::string& key, const T& value);
+
+namespace internal {
+
+template<class T>
+std::shared_ptr<const T> Decode(
+    std::shared_ptr<const char> data, size_t size, std::true_type /* zero_copy */) {
+  static_assert(alignof(T) <= alignof(std::max_align_t),
+                "Over-aligned types can't be served from the cache");
+  if (size != sizeof(T)) {
+    return nullptr;
+  }
+  return std::shared_ptr<const T>(data, reinterpret_cast<const T*>(data.get()));
+}
+
+template<class T>
+std::shared_ptr<const T> Decode(
+    std::shared_ptr<const char> data, size_t size, std::false_type /* zero_copy */) {
+  return std::make_shared<T>(Serializer<T>::Deserialize(data.get(), size));
+}
+
+template<class T>
+void Encode(
+    PersistentCache* cache, const std::string& key, const T& value,
+    std::true_type /* zero_copy */) {
+  cache->Store(key, reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template<class T>
+void Encode(
+    PersistentCache* cache, const std::string& key, const T& value,
+    std::false_type /* zero_copy */) {
+  std::string bytes = Serializer<T>::Serialize(value);
+  cache->Store(key, bytes.data(), bytes.size());
+}
+
+}  // namespace internal
+
+template<class T>
+std::shared_ptr<const T> LoadFromCache(PersistentCache* cache, const std::string& key) {
+  size_t size = 0;
+  std::shared_ptr<const char> data = cache->Lookup(key, &size);
+  if (data == nullptr) {
+    return nullptr;
+  }
+  return internal::Decode<T>(std::move(data), size, IsZeroCopy<T>());
+}
+
+template<class T>
+void StoreInCache(PersistentCache* cache, const std::string& key, const T& value) {
+  internal::Encode<T>(cache, key, value, IsZeroCopy<T>());
+}
+
+}  // namespace ccproducers
+
+#endif  // PERSISTENT_CACHE_H
@@ -14,14 +14,22 @@
 #include <vector>
 
 #include "error.h"
+#include "hedging.h"
 #include "input.h"
+#include "metrics.h"
 #include "node.h"
 #include "output.h"
+#include "persistent_cache.h"
+#include "resource_pool.h"
+#include "worker_pool.h"
 
 namespace {
 
 const char* kDefaultNodeNamePrefix = "unnamed";
 
+// Default cap on concurrently running hedged invocations within one graph.
+const int kDefaultMaxHedgesPerGraph = 4;
+
 std::string CreateNodeName(int id) {
   std::stringstream stream;
   stream << kDefaultNodeNamePrefix << "-" << id;
@@ -36,8 +44,26 @@ namespace ccproducers {
 // outputs wired up to each other.
 class ProducerGraph {
  public:
-  ProducerGraph() : next_id_(0) {}
-  ~ProducerGraph() {}
+  ProducerGraph()
+      : next_id_(0), hedge_budget_(kDefaultMaxHedgesPerGraph),
+        metrics_registry_(nullptr), worker_pool_(nullptr) {}
+
+  ~ProducerGraph() {
+    // Wait for all runs before destroying any node, since the typed part of a
+    // node is torn down before its run is joined. Go in registration order so
+    // that any run which could still launch a consumer has returned by the
+    // time the consumer is waited for.
+    for (const auto& node : nodes_) {
+      node->AwaitRun();
+    }
+
+    // Destroy consumers before the nodes they read from. Destroying a node
+    // waits for its in-flight work (e.g., the losing attempt of a hedged
+    // producer), which may still be reading the outputs of its deps.
+    while (!nodes_.empty()) {
+      nodes_.pop_back();
+    }
+  }
 
   // Runs all the registered producers required to produce the supplied output.
   template<typename T>
@@ -50,6 +76,112 @@ class ProducerGraph {
     return node->ResultFuture();
   }
 
+  // Like Execute(), but the returned future resolves to a handle which owns
+  // the result rather than to a reference into the graph. The graph, along
+  // with all intermediate outputs, can be destroyed as soon as the future has
+  // resolved, while the handle keeps only the requested value alive.
+  template<typename T>
+  std::future<std::shared_ptr<const T>> ExecuteShared(NodeHandle<T>* node_handle) {
+    Node<T>* node = static_cast<Node<T>*>(nodes_by_id_[node_handle->NodeId()]);
+    std::future<std::shared_ptr<const T>> result = node->SharedResultFuture();
+    for (NodeBase* dep : node->TransitiveDeps()) {
+      dep->Start();
+    }
+    return result;
+  }
+
+  // Tags the node behind the supplied handle with a resource pool. The pool
+  // may be shared with other graphs and must outlive this graph.
+  void SetResourcePool(NodeHandleBase* node_handle, ResourcePool* pool) {
+    nodes_by_id_[node_handle->NodeId()]->SetResourcePool(pool);
+  }
+
+  // Enables hedging for the node behind the supplied handle. The producer
+  // must be idempotent. The policy may be shared with other graphs and must
+  // outlive this graph.
+  void SetHedgingPolicy(NodeHandleBase* node_handle, HedgingPolicy* policy) {
+    nodes_by_id_[node_handle->NodeId()]->SetHedgingPolicy(policy, &hedge_budget_);
+  }
+
+  // Caps the number of hedged invocations running at the same time within
+  // this graph. Hedges are additionally capped by HedgeBudget::Global().
+  void SetMaxHedges(int max_hedges) {
+    hedge_budget_.set_max_in_flight(max_hedges);
+  }
+
+  // Makes the node behind the supplied handle serve its output from the
+  // supplied persistent cache if present, and store it there otherwise. The
+  // entry is keyed by the node's name and the supplied fingerprint, which
+  // must change whenever the producer would produce a different value. Only
+  // nodes without inputs can be cached, since the key does not cover input
+  // values. T must be zero copy or have a Serializer specialization. The
+  // cache must outlive this graph.
+  template<typename T>
+  void SetPersistentCache(
+      NodeHandle<T>* node_handle, PersistentCache* cache, std::string fingerprint) {
+    Node<T>* node = static_cast<Node<T>*>(nodes_by_id_[node_handle->NodeId()]);
+    assert(!node->HasDeps());
+    std::string key = node->name() + '\0' + fingerprint;
+    node->SetCache(
+        [cache, key]() { return LoadFromCache<T>(cache, key); },
+        [cache, key](const T& value) { StoreInCache<T>(cache, key, value); });
+  }
+
+  // Makes all nodes of this graph, including ones added later, report their
+  // metrics to the supplied registry under their node names. Nodes added
+  // without a name only count towards the executor metrics, since their
+  // default names don't identify a producer across graphs. The registry may
+  // be shared with other graphs and must outlive this graph.
+  void SetMetricsRegistry(MetricsRegistry* registry) {
+    metrics_registry_ = registry;
+    for (const auto& node : nodes_) {
+      AttachMetrics(node.get());
+    }
+    AttachPoolMetrics();
+  }
+
+  // Makes all nodes of this graph, including ones added later, run on the
+  // supplied worker pool. Each node is placed on the worker which produced
+  // its largest input, so that it finds the input in that worker's caches.
+  // The pool may be shared with other graphs and must outlive this graph.
+  // If this graph also has a metrics registry, the pool reports its steals
+  // there, in which case the registry must outlive the pool as well.
+  void SetWorkerPool(WorkerPool* pool) {
+    worker_pool_ = pool;
+    for (const auto& node : nodes_) {
+      node->SetWorkerPool(pool);
+    }
+    AttachPoolMetrics();
+  }
+
+  // Statically assigns the node behind the supplied handle to a worker of
+  // the graph's pool. Pinned nodes are never stolen by other workers, so
+  // pinning a partition of the graph to a worker keeps it on that worker's
+  // cores. Must be called after SetWorkerPool(), with a worker of that pool.
+  void PinToWorker(NodeHandleBase* node_handle, int worker) {
+    assert(worker_pool_ != nullptr);
+    assert(worker >= 0 && worker < worker_pool_->size());
+    nodes_by_id_[node_handle->NodeId()]->PinToWorker(worker);
+  }
+
+  // Returns how many nodes which have started running so far ended up on the
+  // worker they were placed on. Only meaningful once the graph has been
+  // executed on a worker pool.
+  LocalityStats GetLocalityStats() const {
+    LocalityStats stats{0, 0};
+    for (const auto& node : nodes_) {
+      if (node->worker() < 0 || node->preferred_worker() < 0) {
+        continue;
+      }
+      if (node->worker() == node->preferred_worker()) {
+        ++stats.hits;
+      } else {
+        ++stats.misses;
+      }
+    }
+    return stats;
+  }
+
   // Adds a producer to the graph with no arguments.
   template<typename ReturnType>
   NodeHandle<ReturnType>* AddProducer(std::function<Output<ReturnType>()> f) {
@@ -60,7 +192,8 @@ class ProducerGraph {
   NodeHandle<ReturnType>* AddProducer(
       std::string name, std::function<Output<ReturnType>()> f) {
     int id = next_id_++;
-    if (name.empty()) {
+    bool default_named = name.empty();
+    if (default_named) {
       name = CreateNodeName(id);
     }
 
@@ -77,6 +210,10 @@ class ProducerGraph {
     auto handle = node_handles_.back().get();
 
     nodes_by_id_[id] = node;
+    if (default_named) {
+      default_named_nodes_.insert(node);
+    }
+    AttachNode(node);
     assert(!node->IsDone());
     return static_cast<NodeHandle<ReturnType>*>(handle);
   }
@@ -106,6 +243,11 @@ class ProducerGraph {
     }
 
     int id = next_id_++;
+    bool default_named = name.empty();
+    if (default_named) {
+      name = CreateNodeName(id);
+    }
+
     auto result_handle = std::make_unique<NodeHandle<ReturnType>>(id);
     auto result = std::make_unique<Node<ReturnType>>(
         id,
@@ -118,6 +260,10 @@ class ProducerGraph {
     auto node = nodes_.back().get();
     auto handle = node_handles_.back().get();
     nodes_by_id_[id] = node;
+    if (default_named) {
+      default_named_nodes_.insert(node);
+    }
+    AttachNode(node);
     assert(!node->IsDone());
     return static_cast<NodeHandle<ReturnType>*>(handle);
   }
@@ -156,6 +302,32 @@ class ProducerGraph {
   }
 
  private:
+  void AttachNode(NodeBase* node) {
+    AttachMetrics(node);
+    if (worker_pool_ != nullptr) {
+      node->SetWorkerPool(worker_pool_);
+    }
+  }
+
+  // A pool shared by graphs with different registries reports to the one
+  // attached last.
+  void AttachPoolMetrics() {
+    if (worker_pool_ != nullptr && metrics_registry_ != nullptr) {
+      worker_pool_->SetMetrics(metrics_registry_->executor());
+    }
+  }
+
+  void AttachMetrics(NodeBase* node) {
+    if (metrics_registry_ == nullptr) {
+      return;
+    }
+    NodeMetrics* metrics = nullptr;
+    if (default_named_nodes_.count(node) == 0) {
+      metrics = metrics_registry_->ForNode(node->name());
+    }
+    node->SetMetrics(metrics, metrics_registry_->executor());
+  }
+
   // Partial template speciliazation for the base case, i.e., the case where
   // there is only one node.
   template<typename ReturnType, typename P>
@@ -192,7 +364,13 @@ class ProducerGraph {
   }
 
   int next_id_;
+  HedgeBudget hedge_budget_;
+  MetricsRegistry* metrics_registry_;
+  WorkerPool* worker_pool_;
   std::map<int, NodeBase*> nodes_by_id_;
+
+  // Nodes which were added without a name and got a default one.
+  std::set<NodeBase*> default_named_nodes_;
   std::vector<std::unique_ptr<NodeBase>> nodes_;
   std::vector<std::unique_ptr<NodeHandleBase>> node_handles_;
 };
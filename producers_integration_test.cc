@@ -1,21 +1,48 @@
 // Copyright 2016 Dino Wernli. All Rights Reserved. See LICENSE for licensing terms.
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <csignal>
 #include <cstdio>
+#include <fstream>
 #include <functional>
 #include <memory>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <unistd.h>
 #include <vector>
 
 #include "gtest/gtest.h"
 
+#include "batch.h"
+#include "batch_producer_graph.h"
 #include "error.h"
+#include "hedging.h"
+#include "metrics.h"
+#include "persistent_cache.h"
 #include "producer_graph.h"
+#include "remote_executor.h"
+#include "resource_pool.h"
+#include "serializer.h"
+#include "worker_pool.h"
 
+using ccproducers::Batch;
+using ccproducers::BatchProducerGraph;
 using ccproducers::Error;
+using ccproducers::HedgingPolicy;
+using ccproducers::Histogram;
 using ccproducers::Input;
+using ccproducers::MutableSpan;
+using ccproducers::MetricsRegistry;
 using ccproducers::Output;
+using ccproducers::PersistentCache;
+using ccproducers::RemoteExecutor;
+using ccproducers::RemoteProducer;
+using ccproducers::ResourcePool;
+using ccproducers::Span;
+using ccproducers::WorkerPool;
 
 namespace {
 
@@ -75,8 +102,187 @@ Output<int> ProduceInt(
   return static_cast<int>(f0.get() + f1.get() + f2.get() + f3.get());
 }
 
+// Used to observe how many BackendCall producers run at the same time.
+std::atomic<int> backend_calls_in_flight(0);
+std::atomic<int> backend_calls_max_in_flight(0);
+
+Output<int> BackendCall() {
+  int now = ++backend_calls_in_flight;
+  int max = backend_calls_max_in_flight.load();
+  while (now > max && !backend_calls_max_in_flight.compare_exchange_weak(max, now)) {}
+  std::this_thread::sleep_for (std::chrono::milliseconds(50));
+  --backend_calls_in_flight;
+  return 1;
+}
+
+Output<int> SumBackendCalls(
+    Input<int> i0, Input<int> i1, Input<int> i2, Input<int> i3) {
+  return i0.get() + i1.get() + i2.get() + i3.get();
+}
+
+// Only the first call of a "round" is slow, every other call is fast.
+std::atomic<int> tail_latency_calls(0);
+
+Output<int> TailLatencyProducer() {
+  if (tail_latency_calls++ == 0) {
+    std::this_thread::sleep_for (std::chrono::milliseconds(500));
+  } else {
+    std::this_thread::sleep_for (std::chrono::milliseconds(5));
+  }
+  return 42;
+}
+
+// A trivially copyable table, served straight from the cache's mapping.
+struct LookupTable {
+  int64_t entries[64];
+};
+
+std::atomic<int> lookup_table_builds(0);
+
+Output<LookupTable> BuildLookupTable() {
+  ++lookup_table_builds;
+  LookupTable table;
+  for (int i = 0; i < 64; ++i) {
+    table.entries[i] = i * i;
+  }
+  return std::move(table);
+}
+
+std::atomic<int> string_builds(0);
+
+Output<std::string> BuildString() {
+  ++string_builds;
+  return std::string("expensive string");
+}
+
+// A path for a cache file in the test's temporary directory. The file and
+// the cache's lock file are removed both up front and once the path goes out
+// of scope.
+class CachePath {
+ public:
+  CachePath(const std::string& name) : path_(testing::TempDir() + name) {
+    Remove();
+  }
+  ~CachePath() { Remove(); }
+
+  operator const std::string&() const { return path_; }
+  const char* c_str() const { return path_.c_str(); }
+
+ private:
+  void Remove() {
+    std::remove(path_.c_str());
+    std::remove((path_ + ".lock").c_str());
+  }
+
+  std::string path_;
+};
+
+void AddKernel(MutableSpan<int> sum, Span<int> left, Span<int> right) {
+  for (size_t i = 0; i < sum.size(); ++i) {
+    sum[i] = left[i] + right[i];
+  }
+}
+
+Output<int> Add(Input<int> left, Input<int> right) {
+  return left.get() + right.get();
+}
+
+Output<int> HalveEven(Input<int> number) {
+  if (number.get() % 2 == 1) {
+    return Error("Odd number");
+  }
+  return number.get() / 2;
+}
+
+// Counts how often values are copied rather than moved.
+std::atomic<int> copies_made(0);
+
+struct CopyCounter {
+  CopyCounter() : value(0) {}
+  CopyCounter(int v) : value(v) {}
+  CopyCounter(const CopyCounter& other) : value(other.value) { ++copies_made; }
+  CopyCounter(CopyCounter&& other) = default;
+  CopyCounter& operator=(const CopyCounter& other) {
+    value = other.value;
+    ++copies_made;
+    return *this;
+  }
+  CopyCounter& operator=(CopyCounter&& other) = default;
+
+  int value;
+};
+
+Output<CopyCounter> CountCopiesOfEven(Input<int> number) {
+  if (number.get() % 2 == 1) {
+    std::stringstream message;
+    message << "Odd number: " << number.get();
+    return Error(message.str());
+  }
+  return CopyCounter(number.get());
+}
+
+Output<int> CurrentPid() {
+  return static_cast<int>(getpid());
+}
+
+Output<int> CrashingProducer() {
+  std::raise(SIGKILL);
+  return 0;
+}
+
+Output<std::vector<int>> ProduceManyNumbers() {
+  return std::vector<int>(1 << 16, 1);
+}
+
+Output<int> CurrentWorker() {
+  return WorkerPool::CurrentWorker();
+}
+
+Output<int> WorkerOfConsumer(Input<std::vector<int>> numbers, Input<int> number) {
+  return WorkerPool::CurrentWorker();
+}
+
+Output<int> WorkerOfChild(Input<int> parent) {
+  return WorkerPool::CurrentWorker();
+}
+
+// Not zero copy, with a Serializer which fails as requested.
+struct FragileBlob {
+  bool fail_serialize;
+  bool fail_deserialize;
+  std::string padding;
+};
+
 }  // anonymous namespace
 
+namespace ccproducers {
+
+template<>
+struct Serializer<std::string> {
+  static std::string Serialize(const std::string& value) { return value; }
+  static std::string Deserialize(const char* data, size_t size) {
+    return std::string(data, size);
+  }
+};
+
+template<>
+struct Serializer<FragileBlob> {
+  static std::string Serialize(const FragileBlob& value) {
+    if (value.fail_serialize) {
+      throw std::runtime_error("Unable to serialize");
+    }
+    return std::string(1, value.fail_deserialize ? 'd' : 'o');
+  }
+  static FragileBlob Deserialize(const char* data, size_t size) {
+    if (size != 1 || data[0] == 'd') {
+      throw std::runtime_error("Unable to deserialize");
+    }
+    return FragileBlob{false, false};
+  }
+};
+
+}  // namespace ccproducers
+
 
 TEST(ProducerGraphTest, BasicGraph) {
   ccproducers::ProducerGraph graph;
@@ -147,3 +353,661 @@ TEST(ProducerGraphTest, NodeWithManyInputs) {
   result_future.wait();
   EXPECT_EQ(4, result_future.get());
 }
+
+TEST(ProducerGraphTest, ResourcePoolLimitsConcurrency) {
+  backend_calls_in_flight = 0;
+  backend_calls_max_in_flight = 0;
+  ResourcePool pool("backend", 2);
+
+  // Two graphs sharing the same pool, executed concurrently.
+  ccproducers::ProducerGraph graphs[2];
+  std::vector<std::future<const int&>> futures;
+  for (auto& graph : graphs) {
+    std::vector<ccproducers::NodeHandle<int>*> calls;
+    for (int i = 0; i < 4; ++i) {
+      calls.push_back(graph.AddProducer(&BackendCall));
+      graph.SetResourcePool(calls.back(), &pool);
+    }
+    auto sum = graph.AddProducer(
+        &SumBackendCalls, calls[0], calls[1], calls[2], calls[3]);
+    futures.push_back(graph.Execute(sum));
+  }
+
+  for (auto& future : futures) {
+    EXPECT_EQ(4, future.get());
+  }
+  EXPECT_LE(backend_calls_max_in_flight.load(), 2);
+
+  // Let the last node release its capacity.
+  for (int i = 0; i < 100 && pool.Stats().in_flight > 0; ++i) {
+    std::this_thread::sleep_for (std::chrono::milliseconds(10));
+  }
+  auto stats = pool.Stats();
+  EXPECT_EQ(0, stats.in_flight);
+  EXPECT_EQ(0, stats.queue_depth);
+  EXPECT_EQ(8, stats.admitted);
+  EXPECT_EQ(6, stats.deferred);
+  EXPECT_GT(stats.max_wait.count(), 0);
+}
+
+TEST(ProducerGraphTest, AbandonedGraphLeavesResourcePool) {
+  backend_calls_in_flight = 0;
+  ResourcePool pool("backend", 1);
+  ccproducers::ProducerGraph running;
+  auto slow = running.AddProducer(&BackendCall);
+  running.SetResourcePool(slow, &pool);
+  std::future<const int&> result = running.Execute(slow);
+
+  // The second graph's node queues behind the first one and is abandoned
+  // before it gets capacity.
+  {
+    ccproducers::ProducerGraph abandoned;
+    auto queued = abandoned.AddProducer(&BackendCall);
+    abandoned.SetResourcePool(queued, &pool);
+    std::future<const int&> never = abandoned.Execute(queued);
+    EXPECT_EQ(1, pool.Stats().queue_depth);
+  }
+  EXPECT_EQ(0, pool.Stats().queue_depth);
+
+  EXPECT_EQ(1, result.get());
+  for (int i = 0; i < 100 && pool.Stats().in_flight > 0; ++i) {
+    std::this_thread::sleep_for (std::chrono::milliseconds(10));
+  }
+  EXPECT_EQ(0, pool.Stats().in_flight);
+  EXPECT_EQ(1, pool.Stats().admitted);
+}
+
+TEST(ProducerGraphTest, HedgingCutsTailLatency) {
+  tail_latency_calls = 0;
+  HedgingPolicy policy(std::chrono::milliseconds(20));
+
+  ccproducers::ProducerGraph graph;
+  auto slow = graph.AddProducer(&TailLatencyProducer);
+  graph.SetHedgingPolicy(slow, &policy);
+  auto message = graph.AddProducer(&MessageForNumber, slow);
+
+  auto start = std::chrono::steady_clock::now();
+  auto result_future = graph.Execute(message);
+  EXPECT_EQ("Hello world, number: 42", result_future.get());
+  EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(400));
+
+  EXPECT_EQ(1, policy.hedges_launched());
+  EXPECT_EQ(1, policy.hedges_won());
+}
+
+TEST(ProducerGraphTest, HedgingRespectsGraphBudget) {
+  tail_latency_calls = 0;
+  HedgingPolicy policy(std::chrono::milliseconds(20));
+
+  ccproducers::ProducerGraph graph;
+  graph.SetMaxHedges(0);
+  auto slow = graph.AddProducer(&TailLatencyProducer);
+  graph.SetHedgingPolicy(slow, &policy);
+
+  auto result_future = graph.Execute(slow);
+  EXPECT_EQ(42, result_future.get());
+  EXPECT_EQ(0, policy.hedges_launched());
+  EXPECT_EQ(1, tail_latency_calls.load());
+}
+
+TEST(ProducerGraphTest, HedgesCountAgainstResourcePool) {
+  backend_calls_in_flight = 0;
+  backend_calls_max_in_flight = 0;
+  HedgingPolicy policy(std::chrono::milliseconds(1));
+  ResourcePool pool("backend", 2);
+
+  ccproducers::ProducerGraph hedged;
+  auto call = hedged.AddProducer(&BackendCall);
+  hedged.SetResourcePool(call, &pool);
+  hedged.SetHedgingPolicy(call, &policy);
+  std::future<const int&> hedged_result = hedged.Execute(call);
+  std::this_thread::sleep_for (std::chrono::milliseconds(20));
+  EXPECT_EQ(1, policy.hedges_launched());
+  EXPECT_EQ(2, pool.Stats().in_flight);
+
+  // None of these may start while an attempt of the hedged node runs.
+  ccproducers::ProducerGraph other;
+  std::vector<ccproducers::NodeHandle<int>*> calls;
+  for (int i = 0; i < 4; ++i) {
+    calls.push_back(other.AddProducer(&BackendCall));
+    other.SetResourcePool(calls.back(), &pool);
+  }
+  auto sum = other.AddProducer(
+      &SumBackendCalls, calls[0], calls[1], calls[2], calls[3]);
+  std::future<const int&> other_result = other.Execute(sum);
+
+  EXPECT_EQ(1, hedged_result.get());
+  EXPECT_EQ(4, other_result.get());
+  EXPECT_LE(backend_calls_max_in_flight.load(), 2);
+}
+
+TEST(HedgingPolicyTest, LearnsDelayFromHistory) {
+  HedgingPolicy policy(
+      0.9 /* percentile */,
+      std::chrono::milliseconds(100) /* initial_delay */,
+      10 /* min_samples */);
+  EXPECT_EQ(std::chrono::milliseconds(100), policy.HedgeDelay());
+
+  for (int i = 1; i <= 100; ++i) {
+    policy.RecordLatency(std::chrono::milliseconds(i));
+  }
+  EXPECT_EQ(std::chrono::milliseconds(91), policy.HedgeDelay());
+}
+
+TEST(ProducerGraphTest, SharedResultOutlivesGraph) {
+  auto graph = std::make_unique<ccproducers::ProducerGraph>();
+  auto g = graph->AddProducer(&ProduceString);
+  auto f = graph->AddProducer(&ProduceFoo);
+  auto h = graph->AddProducer(&ProduceNumbers, f, g);
+
+  std::shared_ptr<const std::vector<int>> result = graph->ExecuteShared(h).get();
+  graph.reset();
+
+  ASSERT_EQ(1, result->size());
+  EXPECT_EQ(100, (*result)[0]);
+}
+
+TEST(ProducerGraphTest, SharedResultPropagatesErrors) {
+  ccproducers::ProducerGraph graph;
+  auto f = graph.AddProducer(&ErrorProducer);
+  auto g = graph.AddProducer(&MessageForNumber, f);
+
+  auto result_future = graph.ExecuteShared(g);
+  EXPECT_THROW(result_future.get(), std::exception);
+}
+
+TEST(ProducerGraphTest, MetricsAggregateAcrossGraphs) {
+  MetricsRegistry registry;
+  registry.set_sampling(true);
+
+  for (int i = 0; i < 3; ++i) {
+    ccproducers::ProducerGraph graph;
+    graph.SetMetricsRegistry(&registry);
+    auto number = graph.AddProducer("number", &ProduceOtherNumber);
+    auto message = graph.AddProducer("message", &MessageForNumber, number);
+    EXPECT_EQ("Hello world, number: 10", graph.Execute(message).get());
+  }
+  {
+    ccproducers::ProducerGraph graph;
+    graph.SetMetricsRegistry(&registry);
+    auto number = graph.AddProducer("number", &ErrorProducer);
+    graph.Execute(number).wait();
+  }
+
+  EXPECT_EQ(4, registry.ForNode("number")->runs());
+  EXPECT_EQ(1, registry.ForNode("number")->errors());
+  EXPECT_EQ(3, registry.ForNode("message")->runs());
+  EXPECT_EQ(0, registry.executor()->active_workers());
+  EXPECT_EQ(0, registry.executor()->queue_depth());
+  EXPECT_EQ(7, registry.executor()->launches());
+
+  Histogram run_time;
+  registry.ForNode("message")->MergeRunTime(&run_time);
+  EXPECT_EQ(3, run_time.count());
+
+  std::string text = registry.ToPrometheusText();
+  EXPECT_NE(std::string::npos,
+            text.find("ccproducers_node_runs_total{node=\"number\"} 4\n"));
+  EXPECT_NE(std::string::npos,
+            text.find("ccproducers_node_errors_total{node=\"number\"} 1\n"));
+  EXPECT_NE(std::string::npos,
+            text.find("ccproducers_node_run_time_microseconds_count{node=\"message\"} 3\n"));
+  EXPECT_NE(std::string::npos, text.find("ccproducers_executor_launches_total 7\n"));
+}
+
+TEST(ProducerGraphTest, UnnamedNodesOnlyReportExecutorMetrics) {
+  MetricsRegistry registry;
+  for (int i = 0; i < 2; ++i) {
+    ccproducers::ProducerGraph graph;
+    graph.SetMetricsRegistry(&registry);
+    auto number = graph.AddProducer(i == 0 ? &ProduceOtherNumber : &ErrorProducer);
+    auto message = graph.AddProducer(&MessageForNumber, number);
+    graph.Execute(message).wait();
+  }
+
+  std::string text = registry.ToPrometheusText();
+  EXPECT_EQ(std::string::npos, text.find("node=\""));
+  EXPECT_NE(std::string::npos, text.find("ccproducers_executor_launches_total 4\n"));
+}
+
+TEST(ProducerGraphTest, MetricsWithoutSamplingOnlyCount) {
+  MetricsRegistry registry;
+  {
+    // Destroying the graph waits for the run to finish reporting.
+    ccproducers::ProducerGraph graph;
+    graph.SetMetricsRegistry(&registry);
+    auto number = graph.AddProducer("number", &ProduceOtherNumber);
+    EXPECT_EQ(10, graph.Execute(number).get());
+  }
+
+  Histogram run_time;
+  registry.ForNode("number")->MergeRunTime(&run_time);
+  EXPECT_EQ(1, registry.ForNode("number")->runs());
+  EXPECT_EQ(0, run_time.count());
+}
+
+TEST(HistogramTest, BucketsBoundRelativeError) {
+  Histogram histogram;
+  for (int64_t value = 1; value <= 1000; ++value) {
+    histogram.Record(value);
+  }
+  EXPECT_EQ(1000, histogram.count());
+  EXPECT_EQ(500500, histogram.sum());
+
+  // With 8 sub-buckets per power of two, bounds are within 12.5%.
+  int64_t p50 = histogram.ValueAtPercentile(0.5);
+  EXPECT_GE(p50, 500);
+  EXPECT_LE(p50, 500 * 1.125 + 1);
+
+  for (int64_t value : {0LL, 7LL, 8LL, 1000LL, 123456789LL}) {
+    int bucket = Histogram::BucketFor(value);
+    EXPECT_LT(value, Histogram::BucketUpperBound(bucket));
+    if (bucket > 0) {
+      EXPECT_GE(value, Histogram::BucketUpperBound(bucket - 1));
+    }
+  }
+
+  Histogram merged;
+  merged.Merge(histogram);
+  merged.Merge(histogram);
+  EXPECT_EQ(2000, merged.count());
+  EXPECT_EQ(p50, merged.ValueAtPercentile(0.5));
+}
+
+TEST(ProducerGraphTest, PersistentCacheSurvivesRestart) {
+  CachePath path("persistent_cache_restart");
+  lookup_table_builds = 0;
+  string_builds = 0;
+
+  // Simulates a number of process restarts by reopening the cache.
+  for (int restart = 0; restart < 3; ++restart) {
+    PersistentCache cache(path, 1 /* version */);
+    ccproducers::ProducerGraph graph;
+    auto table = graph.AddProducer("table", &BuildLookupTable);
+    auto str = graph.AddProducer("string", &BuildString);
+    graph.SetPersistentCache(table, &cache, "v1");
+    graph.SetPersistentCache(str, &cache, "v1");
+
+    std::shared_ptr<const LookupTable> result = graph.ExecuteShared(table).get();
+    EXPECT_EQ(63 * 63, result->entries[63]);
+    EXPECT_EQ("expensive string", graph.Execute(str).get());
+    EXPECT_EQ(restart == 0 ? 0 : 2, cache.hits());
+  }
+  EXPECT_EQ(1, lookup_table_builds.load());
+  EXPECT_EQ(1, string_builds.load());
+
+  // A different version discards all entries.
+  PersistentCache cache(path, 2 /* version */);
+  ccproducers::ProducerGraph graph;
+  auto table = graph.AddProducer("table", &BuildLookupTable);
+  graph.SetPersistentCache(table, &cache, "v1");
+  EXPECT_EQ(0, graph.Execute(table).get().entries[0]);
+  EXPECT_EQ(0, cache.hits());
+  EXPECT_EQ(2, lookup_table_builds.load());
+}
+
+TEST(ProducerGraphTest, FailingCacheDoesNotFailNode) {
+  CachePath path("persistent_cache_failing");
+  PersistentCache cache(path, 1 /* version */);
+  std::atomic<int> builds(0);
+  auto execute = [&cache, &builds](FragileBlob blob) {
+    ccproducers::ProducerGraph graph;
+    auto node = graph.AddProducer("blob", std::function<Output<FragileBlob>()>(
+        [&builds, blob]() { ++builds; return Output<FragileBlob>(FragileBlob(blob)); }));
+    graph.SetPersistentCache(node, &cache, "v1");
+    auto future = graph.Execute(node);
+    EXPECT_EQ(std::future_status::ready, future.wait_for(std::chrono::seconds(5)));
+    return future.get().fail_deserialize;
+  };
+
+  // Neither a value which can't be stored nor one which can't be loaded back
+  // keeps the producer's output from being served.
+  EXPECT_FALSE(execute(FragileBlob{true, false}));
+  EXPECT_TRUE(execute(FragileBlob{false, true}));
+  EXPECT_TRUE(execute(FragileBlob{false, true}));
+  EXPECT_EQ(3, builds.load());
+}
+
+TEST(ProducerGraphTest, OnlyNodesWithoutInputsCanBeCached) {
+  CachePath path("persistent_cache_inputs");
+  PersistentCache cache(path, 1 /* version */);
+  ccproducers::ProducerGraph graph;
+  auto number = graph.AddProducer(&ProduceOtherNumber);
+  auto message = graph.AddProducer("message", &MessageForNumber, number);
+  EXPECT_DEBUG_DEATH(graph.SetPersistentCache(message, &cache, "v1"), "HasDeps");
+}
+
+TEST(PersistentCacheTest, ServedValuesOutliveCache) {
+  CachePath path("persistent_cache_outlive");
+  {
+    PersistentCache cache(path, 1 /* version */);
+    ccproducers::StoreInCache<int64_t>(&cache, "key", 42);
+  }
+
+  std::shared_ptr<const int64_t> value;
+  {
+    PersistentCache cache(path, 1 /* version */);
+    value = ccproducers::LoadFromCache<int64_t>(&cache, "key");
+    EXPECT_EQ(nullptr, ccproducers::LoadFromCache<int64_t>(&cache, "other"));
+  }
+  ASSERT_NE(nullptr, value);
+  EXPECT_EQ(42, *value);
+  EXPECT_EQ(0, reinterpret_cast<uintptr_t>(value.get()) % alignof(std::max_align_t));
+}
+
+TEST(PersistentCacheTest, ReplacingFileKeepsServedValuesValid) {
+  CachePath path("persistent_cache_replace");
+  struct LargeValue {
+    int64_t words[8192];
+  };
+  auto large = std::make_unique<LargeValue>();
+  for (int i = 0; i < 8192; ++i) {
+    large->words[i] = i;
+  }
+  {
+    PersistentCache cache(path, 1 /* version */);
+    ccproducers::StoreInCache<LargeValue>(&cache, "large", *large);
+  }
+
+  // A process of the old version serves the value from its mapping while a
+  // process of the new version discards the file.
+  PersistentCache old_cache(path, 1 /* version */);
+  std::shared_ptr<const LargeValue> value =
+      ccproducers::LoadFromCache<LargeValue>(&old_cache, "large");
+  ASSERT_NE(nullptr, value);
+  PersistentCache new_cache(path, 2 /* version */);
+  EXPECT_EQ(nullptr, ccproducers::LoadFromCache<LargeValue>(&new_cache, "large"));
+  EXPECT_EQ(8191, value->words[8191]);
+}
+
+TEST(PersistentCacheTest, ConcurrentWritersKeepAllEntries) {
+  CachePath path("persistent_cache_writers");
+  {
+    PersistentCache first(path, 1 /* version */);
+    PersistentCache second(path, 1 /* version */);
+    ccproducers::StoreInCache<int64_t>(&first, "first", 1);
+    ccproducers::StoreInCache<int64_t>(&second, "second", 2);
+    ccproducers::StoreInCache<int64_t>(&first, "third", 3);
+  }
+
+  PersistentCache cache(path, 1 /* version */);
+  for (const auto& key : {"first", "second", "third"}) {
+    EXPECT_NE(nullptr, ccproducers::LoadFromCache<int64_t>(&cache, key)) << key;
+  }
+}
+
+TEST(PersistentCacheTest, CorruptEntriesDiscardCache) {
+  struct Corruption {
+    long offset;
+    uint64_t value;
+    size_t size;
+  };
+
+  // The first entry's key size, value size and value, for a 3 byte key.
+  std::vector<Corruption> corruptions = {
+      {36, 0xffffffff, sizeof(uint32_t)},
+      {40, ~uint64_t(0) - 63, sizeof(uint64_t)},
+      {80, 43, sizeof(int64_t)}};
+  for (const Corruption& corruption : corruptions) {
+    CachePath path("persistent_cache_corrupt");
+    {
+      PersistentCache cache(path, 1 /* version */);
+      ccproducers::StoreInCache<int64_t>(&cache, "key", 42);
+    }
+    FILE* file = std::fopen(path.c_str(), "r+b");
+    ASSERT_NE(nullptr, file);
+    std::fseek(file, corruption.offset, SEEK_SET);
+    std::fwrite(&corruption.value, corruption.size, 1, file);
+    std::fclose(file);
+
+    {
+      PersistentCache cache(path, 1 /* version */);
+      EXPECT_EQ(nullptr, ccproducers::LoadFromCache<int64_t>(&cache, "key"))
+          << corruption.offset;
+      ccproducers::StoreInCache<int64_t>(&cache, "key", 44);
+    }
+    PersistentCache cache(path, 1 /* version */);
+    std::shared_ptr<const int64_t> value =
+        ccproducers::LoadFromCache<int64_t>(&cache, "key");
+    ASSERT_NE(nullptr, value);
+    EXPECT_EQ(44, *value);
+  }
+}
+
+TEST(BatchProducerGraphTest, PerElementAndVectorizedProducers) {
+  BatchProducerGraph batch(4);
+  auto left = batch.AddInput<int>("left", {1, 2, 3, 4});
+  auto right = batch.AddInput<int>("right", {10, 20, 30, 40});
+  auto ten = batch.AddProducer("ten", &ProduceOtherNumber);
+  auto vectorized = batch.AddBatchProducer("vectorized", &AddKernel, left, right);
+  auto per_element = batch.AddProducer("per_element", &Add, vectorized, ten);
+  auto message = batch.AddProducer("message", &MessageForNumber, per_element);
+
+  const Batch<std::string>& result = batch.Execute(message).get();
+  ASSERT_EQ(4, result.size());
+  EXPECT_EQ("Hello world, number: 21", result.get(0));
+  EXPECT_EQ("Hello world, number: 54", result.get(3));
+}
+
+TEST(BatchProducerGraphTest, FailuresStayPerRequest) {
+  BatchProducerGraph batch(4);
+  auto numbers = batch.AddInput<int>("numbers", {0, 1, 2, 3});
+  auto halves = batch.AddProducer("halves", &HalveEven, numbers);
+  auto sum = batch.AddBatchProducer("sum", &AddKernel, halves, numbers);
+
+  std::shared_ptr<const Batch<int>> result = batch.ExecuteShared(sum).get();
+  ASSERT_EQ(4, result->size());
+  EXPECT_EQ(0, result->get(0));
+  EXPECT_TRUE(result->IsError(1));
+  EXPECT_EQ(3, result->get(2));
+  EXPECT_TRUE(result->IsError(3));
+}
+
+TEST(BatchProducerGraphTest, PerElementOutputsAreMovedIntoBatch) {
+  copies_made = 0;
+  BatchProducerGraph batch(3);
+  auto numbers = batch.AddInput<int>("numbers", {2, 3, 4});
+  auto counted = batch.AddProducer("counted", &CountCopiesOfEven, numbers);
+
+  std::shared_ptr<const Batch<CopyCounter>> result = batch.ExecuteShared(counted).get();
+  EXPECT_EQ(0, copies_made.load());
+  EXPECT_EQ(2, result->get(0).value);
+  ASSERT_TRUE(result->IsError(1));
+  EXPECT_NE(std::string::npos, result->error(1).ToString().find("Odd number: 3"));
+  EXPECT_EQ(4, result->get(2).value);
+}
+
+TEST(BatchProducerGraphTest, InputsAreNotCopied) {
+  std::vector<CopyCounter> values;
+  values.reserve(3);
+  for (int i = 0; i < 3; ++i) {
+    values.emplace_back(i);
+  }
+  copies_made = 0;
+  BatchProducerGraph batch(3);
+  auto counters = batch.AddInput<CopyCounter>("counters", std::move(values));
+
+  std::shared_ptr<const Batch<CopyCounter>> result = batch.ExecuteShared(counters).get();
+  EXPECT_EQ(0, copies_made.load());
+  EXPECT_EQ(2, result->get(2).value);
+}
+
+TEST(SerializerTest, ZeroCopySizeMustMatch) {
+  int64_t value = 42;
+  const char* data = reinterpret_cast<const char*>(&value);
+  EXPECT_EQ(42, ccproducers::Serializer<int64_t>::Deserialize(data, sizeof(value)));
+  EXPECT_DEBUG_DEATH(ccproducers::Serializer<int64_t>::Deserialize(data, 4), "sizeof");
+}
+
+TEST(RemoteExecutorTest, ProducersRunInWorkerProcesses) {
+  RemoteExecutor executor(2 /* num_workers */);
+
+  ccproducers::ProducerGraph graph;
+  auto pid = graph.AddProducer("pid", RemoteProducer(&executor, &CurrentPid));
+  auto left = graph.AddProducer(&ProduceOtherNumber);
+  auto sum = graph.AddProducer("sum", RemoteProducer(&executor, &Add), left, left);
+  auto message = graph.AddProducer(
+      "message", RemoteProducer(&executor, &MessageForNumber), sum);
+
+  EXPECT_EQ("Hello world, number: 20", graph.Execute(message).get());
+  int worker_pid = graph.Execute(pid).get();
+  EXPECT_NE(getpid(), worker_pid);
+  std::vector<pid_t> worker_pids = executor.worker_pids();
+  EXPECT_NE(worker_pids.end(),
+            std::find(worker_pids.begin(), worker_pids.end(), worker_pid));
+}
+
+TEST(RemoteExecutorTest, ProducerErrorsKeepTheirMessage) {
+  RemoteExecutor executor(1 /* num_workers */);
+  auto halve = RemoteProducer(&executor, &HalveEven);
+  int odd = 3;
+  Output<int> output = halve(Input<int>(&odd));
+  ASSERT_TRUE(output.IsError());
+  EXPECT_NE(std::string::npos, output.TakeError().ToString().find("Odd number"));
+}
+
+TEST(RemoteExecutorTest, WorkerCrashIsIsolated) {
+  RemoteExecutor executor(1 /* num_workers */);
+
+  // Every crash fails only the call which caused it, the worker is replaced.
+  for (int i = 0; i < 3; ++i) {
+    ccproducers::ProducerGraph graph;
+    auto crash = graph.AddProducer("crash", RemoteProducer(&executor, &CrashingProducer));
+    auto message = graph.AddProducer(&MessageForNumber, crash);
+    EXPECT_THROW(graph.Execute(message).get(), std::exception);
+  }
+  EXPECT_EQ(3, executor.worker_deaths());
+
+  ccproducers::ProducerGraph graph;
+  auto pid = graph.AddProducer("pid", RemoteProducer(&executor, &CurrentPid));
+  int worker_pid = graph.Execute(pid).get();
+  EXPECT_NE(getpid(), worker_pid);
+}
+
+TEST(RemoteExecutorTest, KilledIdleWorkerIsReplaced) {
+  RemoteExecutor executor(2 /* num_workers */);
+  for (int i = 0; i < 100 && executor.worker_pids().size() < 2; ++i) {
+    std::this_thread::sleep_for (std::chrono::milliseconds(10));
+  }
+  std::vector<pid_t> worker_pids = executor.worker_pids();
+  ASSERT_EQ(2, worker_pids.size());
+  for (pid_t pid : worker_pids) {
+    kill(pid, SIGKILL);
+  }
+  for (int i = 0; i < 100 && executor.worker_deaths() < 2; ++i) {
+    std::this_thread::sleep_for (std::chrono::milliseconds(10));
+  }
+
+  ccproducers::ProducerGraph graph;
+  auto left = graph.AddProducer(&ProduceOtherNumber);
+  auto sum = graph.AddProducer("sum", RemoteProducer(&executor, &Add), left, left);
+  EXPECT_EQ(20, graph.Execute(sum).get());
+  EXPECT_EQ(2, executor.worker_deaths());
+}
+
+TEST(RemoteExecutorTest, WorkersDieWithTheirParent) {
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  pid_t parent = fork();
+  ASSERT_LE(0, parent);
+  if (parent == 0) {
+    RemoteExecutor executor(2 /* num_workers */);
+    while (executor.worker_pids().size() < 2) {
+      std::this_thread::sleep_for (std::chrono::milliseconds(10));
+    }
+    std::vector<pid_t> worker_pids = executor.worker_pids();
+    write(fds[1], worker_pids.data(), 2 * sizeof(pid_t));
+    while (true) {
+      pause();
+    }
+  }
+
+  pid_t worker_pids[2];
+  ASSERT_EQ(sizeof(worker_pids), read(fds[0], worker_pids, sizeof(worker_pids)));
+  close(fds[0]);
+  close(fds[1]);
+  kill(parent, SIGKILL);
+  waitpid(parent, nullptr, 0);
+
+  // The workers are no children of this process, so they may linger as
+  // zombies until their new parent reaps them.
+  auto alive = [](pid_t pid) {
+    std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+    std::string skipped;
+    char state = 'X';
+    stat >> skipped >> skipped >> state;
+    return state != 'X' && state != 'Z';
+  };
+  for (pid_t pid : worker_pids) {
+    for (int i = 0; i < 100 && alive(pid); ++i) {
+      std::this_thread::sleep_for (std::chrono::milliseconds(10));
+    }
+    EXPECT_FALSE(alive(pid)) << pid;
+  }
+}
+
+TEST(WorkerPoolTest, NodesFollowLargestInput) {
+  WorkerPool pool(4 /* num_workers */);
+  ccproducers::ProducerGraph graph;
+  graph.SetWorkerPool(&pool);
+  auto small = graph.AddProducer("small", &ProduceOtherNumber);
+  auto large = graph.AddProducer("large", &ProduceManyNumbers);
+  auto consumer = graph.AddProducer("consumer", &WorkerOfConsumer, large, small);
+  graph.PinToWorker(small, 0);
+  graph.PinToWorker(large, 2);
+
+  // The consumer may be stolen if its worker is slow to pick it up, in which
+  // case the miss must be counted.
+  int worker = graph.Execute(consumer).get();
+  ccproducers::LocalityStats stats = graph.GetLocalityStats();
+  EXPECT_EQ(3, stats.hits + stats.misses);
+  EXPECT_EQ(stats.misses == 0, worker == 2);
+  EXPECT_EQ(3, pool.Stats().tasks);
+}
+
+TEST(WorkerPoolTest, PinnedPartitionsStayOnTheirWorker) {
+  WorkerPool pool({{0}, {}, {}} /* core_groups */);
+  ccproducers::ProducerGraph graph;
+  auto left = graph.AddProducer("left", &CurrentWorker);
+  auto left_child = graph.AddProducer("left_child", &WorkerOfChild, left);
+  auto right = graph.AddProducer("right", &CurrentWorker);
+  auto right_child = graph.AddProducer("right_child", &WorkerOfChild, right);
+  graph.SetWorkerPool(&pool);
+  graph.PinToWorker(left, 1);
+  graph.PinToWorker(left_child, 1);
+  graph.PinToWorker(right, 2);
+  graph.PinToWorker(right_child, 2);
+
+  EXPECT_EQ(1, graph.Execute(left_child).get());
+  EXPECT_EQ(2, graph.Execute(right_child).get());
+  EXPECT_EQ(1, graph.Execute(left).get());
+  ccproducers::LocalityStats stats = graph.GetLocalityStats();
+  EXPECT_EQ(4, stats.hits);
+  EXPECT_EQ(0, stats.misses);
+  EXPECT_DOUBLE_EQ(1.0, stats.HitRate());
+  EXPECT_EQ(0, pool.Stats().steals);
+}
+
+TEST(WorkerPoolTest, StealsAreReportedToGraphMetrics) {
+  MetricsRegistry registry;
+  WorkerPool pool(2 /* num_workers */);
+  ccproducers::ProducerGraph graph;
+  graph.SetWorkerPool(&pool);
+  graph.SetMetricsRegistry(&registry);
+
+  // Keep worker 0 busy so that the task queued behind it gets stolen.
+  std::promise<void> unblock;
+  std::shared_future<void> unblocked = unblock.get_future().share();
+  pool.Submit(0, true /* pinned */, [unblocked]() { unblocked.wait(); });
+  std::promise<int> stolen_by;
+  pool.Submit(0, false /* pinned */, [&stolen_by]() {
+    stolen_by.set_value(WorkerPool::CurrentWorker());
+  });
+
+  EXPECT_EQ(1, stolen_by.get_future().get());
+  unblock.set_value();
+  EXPECT_EQ(1, registry.executor()->steals());
+  EXPECT_NE(std::string::npos,
+            registry.ToPrometheusText().find("ccproducers_executor_steals_total 1"));
+}
+
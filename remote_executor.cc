@@ -0,0 +1,451 @@
+// Copyright 2016 Dino Wernli. All Rights Reserved. See LICENSE for licensing terms.
+
+#include "remote_executor.h"
+
+#include <assert.h>
+#include <atomic>
+#include <cerrno>
+#include <ctime>
+#include <future>
+#include <iostream>
+#include <new>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+
+// The states a slot goes through. Only the owner of a state may move the slot
+// out of it: the caller owns FREE (after claiming it), WRITING and DONE, the
+// worker owns REQUEST (after claiming it) and RUNNING.
+enum SlotState : uint32_t { FREE, WRITING, REQUEST, RUNNING, DONE };
+
+// A slot's state is stored together with the pid of the worker owning the
+// slot, if any, so that a worker claims a slot and publishes that it did in
+// a single step.
+uint64_t PackState(SlotState state, pid_t worker) {
+  return (static_cast<uint64_t>(static_cast<uint32_t>(worker)) << 32) | state;
+}
+
+SlotState StateOf(uint64_t packed) {
+  return static_cast<SlotState>(packed & 0xffffffff);
+}
+
+pid_t WorkerOf(uint64_t packed) {
+  return static_cast<pid_t>(packed >> 32);
+}
+
+// How often a waiting caller checks whether the workers are still alive.
+const long kLivenessCheckNanos = 50 * 1000 * 1000;
+
+size_t RoundUp(size_t size, size_t alignment) {
+  return (size + alignment - 1) / alignment * alignment;
+}
+
+// Waits for the semaphore, retrying if interrupted by a signal.
+void WaitSemaphore(sem_t* semaphore) {
+  while (sem_wait(semaphore) != 0 && errno == EINTR) {}
+}
+
+// Returns false if the timeout expired before the semaphore was posted.
+bool TimedWaitSemaphore(sem_t* semaphore, long nanos) {
+  timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_nsec += nanos;
+  deadline.tv_sec += deadline.tv_nsec / 1000000000;
+  deadline.tv_nsec %= 1000000000;
+  while (sem_timedwait(semaphore, &deadline) != 0) {
+    if (errno != EINTR) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Makes the calling process, which was just forked by the supplied parent,
+// get killed once the parent dies. The parent may have died before this was
+// requested, in which case the process has already been reparented.
+void DieWithParent(pid_t parent) {
+  if (prctl(PR_SET_PDEATHSIG, SIGKILL) != 0 || getppid() != parent) {
+    _exit(1);
+  }
+}
+
+}  // namespace
+
+namespace ccproducers {
+
+struct RemoteExecutor::Header {
+  // Posted once per request, and once per worker on shutdown.
+  sem_t requests;
+
+  // Counts the slots in state FREE.
+  sem_t free_slots;
+
+  std::atomic<bool> shutdown;
+
+  // Where callers start looking for a free slot, making the slots a ring.
+  std::atomic<uint32_t> next_slot;
+
+  // Total number of workers which have died.
+  std::atomic<int64_t> worker_deaths;
+};
+
+// Followed by slot_bytes of input and slot_bytes of output.
+struct RemoteExecutor::Slot {
+  // A packed SlotState and owning worker, see PackState().
+  std::atomic<uint64_t> state;
+
+  // Posted by the worker once the response is ready.
+  sem_t done;
+
+  uintptr_t invoker;
+  uintptr_t function;
+  uint64_t input_size;
+  uint64_t output_size;
+  CallStatus status;
+
+  char* input() {
+    return reinterpret_cast<char*>(this) +
+        RoundUp(sizeof(Slot), internal::kRemoteAlignment);
+  }
+};
+
+RemoteExecutor::RemoteExecutor(int num_workers, int num_slots, size_t slot_bytes) :
+    num_workers_(num_workers), num_slots_(num_slots),
+    slot_bytes_(RoundUp(slot_bytes, internal::kRemoteAlignment)),
+    supervisor_pid_(-1), supervisor_died_(false), stopping_(false) {
+  assert(num_workers > 0);
+  assert(num_slots > 0);
+  slot_stride_ = RoundUp(sizeof(Slot), internal::kRemoteAlignment) + 2 * slot_bytes_;
+  region_size_ = RoundUp(sizeof(Header), internal::kRemoteAlignment) +
+      RoundUp(num_workers_ * sizeof(std::atomic<pid_t>), internal::kRemoteAlignment) +
+      num_slots_ * slot_stride_;
+
+  region_ = mmap(nullptr, region_size_, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (region_ == MAP_FAILED) {
+    throw std::runtime_error("Unable to map shared memory for remote executor");
+  }
+
+  header_ = new (region_) Header();
+  sem_init(&header_->requests, 1 /* pshared */, 0);
+  sem_init(&header_->free_slots, 1 /* pshared */, num_slots_);
+  header_->shutdown = false;
+  header_->next_slot = 0;
+  header_->worker_deaths = 0;
+  for (int i = 0; i < num_workers_; ++i) {
+    new (&Workers()[i]) std::atomic<pid_t>(0);
+  }
+  for (int i = 0; i < num_slots_; ++i) {
+    Slot* slot = new (GetSlot(i)) Slot();
+    slot->state = PackState(FREE, 0);
+    sem_init(&slot->done, 1 /* pshared */, 0);
+  }
+
+  // Make sure buffered output isn't flushed once by every process.
+  std::cout.flush();
+
+  // The supervisor is killed once the thread which forked it exits, rather
+  // than the process, so it is forked by a thread living as long as this
+  // executor.
+  pid_t parent = getpid();
+  std::promise<pid_t> forked;
+  forking_thread_ = std::thread([this, parent, &forked]() {
+    pid_t pid = fork();
+    if (pid == 0) {
+      DieWithParent(parent);
+      SupervisorLoop();
+    }
+    forked.set_value(pid);
+    std::unique_lock<std::mutex> lock(supervisor_lock_);
+    stopped_.wait(lock, [this]() { return stopping_; });
+  });
+  supervisor_pid_ = forked.get_future().get();
+  if (supervisor_pid_ < 0) {
+    StopForkingThread();
+    throw std::runtime_error("Unable to fork remote supervisor");
+  }
+}
+
+RemoteExecutor::~RemoteExecutor() {
+  // Every worker exits once it sees a post after shutdown. The supervisor
+  // exits once all workers have.
+  header_->shutdown = true;
+  for (int i = 0; i < num_workers_; ++i) {
+    sem_post(&header_->requests);
+  }
+  {
+    std::lock_guard<std::mutex> lock(supervisor_lock_);
+    if (!supervisor_died_) {
+      waitpid(supervisor_pid_, nullptr, 0);
+    }
+  }
+  StopForkingThread();
+
+  for (int i = 0; i < num_slots_; ++i) {
+    sem_destroy(&GetSlot(i)->done);
+  }
+  sem_destroy(&header_->requests);
+  sem_destroy(&header_->free_slots);
+  munmap(region_, region_size_);
+}
+
+void RemoteExecutor::StopForkingThread() {
+  {
+    std::lock_guard<std::mutex> lock(supervisor_lock_);
+    stopping_ = true;
+  }
+  stopped_.notify_all();
+  forking_thread_.join();
+}
+
+std::atomic<pid_t>* RemoteExecutor::Workers() const {
+  char* workers = static_cast<char*>(region_) +
+      RoundUp(sizeof(Header), internal::kRemoteAlignment);
+  return reinterpret_cast<std::atomic<pid_t>*>(workers);
+}
+
+RemoteExecutor::Slot* RemoteExecutor::GetSlot(int index) const {
+  char* slots = reinterpret_cast<char*>(Workers()) +
+      RoundUp(num_workers_ * sizeof(std::atomic<pid_t>), internal::kRemoteAlignment);
+  return reinterpret_cast<Slot*>(slots + index * slot_stride_);
+}
+
+std::vector<pid_t> RemoteExecutor::worker_pids() const {
+  std::vector<pid_t> result;
+  for (int i = 0; i < num_workers_; ++i) {
+    pid_t pid = Workers()[i];
+    if (pid != 0) {
+      result.push_back(pid);
+    }
+  }
+  return result;
+}
+
+int64_t RemoteExecutor::worker_deaths() const {
+  return header_->worker_deaths;
+}
+
+RemoteExecutor::CallStatus RemoteExecutor::Call(
+    Invoker invoker,
+    GenericFunction function,
+    const std::function<int64_t(char*, size_t)>& write_input,
+    const std::function<void(CallStatus, const char*, size_t)>& read_output) {
+  // Claim a free slot, starting at the current position of the ring.
+  Slot* slot = nullptr;
+  while (slot == nullptr) {
+    if (!TimedWaitSemaphore(&header_->free_slots, kLivenessCheckNanos)) {
+      if (NoWorkersLeft()) {
+        return CallStatus::WORKER_DIED;
+      }
+      continue;
+    }
+    uint32_t start = header_->next_slot++;
+    for (int i = 0; i < num_slots_ && slot == nullptr; ++i) {
+      Slot* candidate = GetSlot((start + i) % num_slots_);
+      uint64_t expected = PackState(FREE, 0);
+      if (candidate->state.compare_exchange_strong(expected, PackState(WRITING, 0))) {
+        slot = candidate;
+      }
+    }
+    assert(slot != nullptr);
+  }
+
+  int64_t input_size = write_input(slot->input(), slot_bytes_);
+  if (input_size < 0) {
+    slot->state = PackState(FREE, 0);
+    sem_post(&header_->free_slots);
+    return CallStatus::INPUT_TOO_LARGE;
+  }
+  slot->invoker = reinterpret_cast<uintptr_t>(invoker);
+  slot->function = reinterpret_cast<uintptr_t>(function);
+  slot->input_size = input_size;
+  slot->output_size = 0;
+  slot->state = PackState(REQUEST, 0);
+  sem_post(&header_->requests);
+
+  // Wait for the response, giving up if the worker handling the request (or
+  // every worker, while nobody has picked it up yet) dies. A request whose
+  // worker died before claiming it is picked up by another worker.
+  CallStatus status;
+  while (true) {
+    if (TimedWaitSemaphore(&slot->done, kLivenessCheckNanos)) {
+      status = slot->status;
+      break;
+    }
+    pid_t worker = WorkerOf(slot->state);
+    if ((worker != 0 && !WorkerAlive(worker)) || NoWorkersLeft()) {
+      // The worker may have completed the call right before dying, in which
+      // case a post must be consumed before the slot can be reused, unless
+      // the worker died before posting. Nobody else touches the slot anymore.
+      if (sem_trywait(&slot->done) == 0 || StateOf(slot->state) == DONE) {
+        status = slot->status;
+      } else {
+        status = CallStatus::WORKER_DIED;
+      }
+      break;
+    }
+  }
+
+  if (status == CallStatus::OK || status == CallStatus::PRODUCER_ERROR) {
+    read_output(status, slot->input() + slot_bytes_, slot->output_size);
+  }
+  slot->state = PackState(FREE, 0);
+  sem_post(&header_->free_slots);
+  return status;
+}
+
+void RemoteExecutor::SupervisorLoop() {
+  for (int i = 0; i < num_workers_; ++i) {
+    ForkWorker(i);
+  }
+
+  while (true) {
+    pid_t pid = waitpid(-1, nullptr, 0);
+    if (pid < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      // No workers left, either because of shutdown or because none could
+      // be forked.
+      _exit(0);
+    }
+
+    int index = -1;
+    for (int i = 0; i < num_workers_; ++i) {
+      pid_t expected = pid;
+      if (Workers()[i].compare_exchange_strong(expected, 0)) {
+        index = i;
+      }
+    }
+    ++header_->worker_deaths;
+    if (index < 0 || header_->shutdown) {
+      continue;
+    }
+
+    std::cout << "[remote_executor] Worker " << pid << " died, replacing it"
+              << std::endl;
+
+    // The worker may have taken the post for a request without claiming its
+    // slot. Posting on its behalf is harmless otherwise, since workers go
+    // back to waiting if they find no request.
+    sem_post(&header_->requests);
+    ForkWorker(index);
+  }
+}
+
+pid_t RemoteExecutor::ForkWorker(int index) {
+  std::cout.flush();
+  pid_t supervisor = getpid();
+  pid_t pid = fork();
+  if (pid < 0) {
+    std::cout << "[remote_executor] Unable to fork worker" << std::endl;
+    return -1;
+  }
+  if (pid == 0) {
+    DieWithParent(supervisor);
+
+    // Publish the pid before claiming any slot, so that callers can always
+    // tell whether the owner of a slot is alive.
+    Workers()[index] = getpid();
+    WorkerLoop();
+  }
+  Workers()[index] = pid;
+  return pid;
+}
+
+void RemoteExecutor::WorkerLoop() {
+  pid_t self = getpid();
+  while (true) {
+    WaitSemaphore(&header_->requests);
+    if (header_->shutdown) {
+      _exit(0);
+    }
+
+    // Claiming the slot records this worker as its owner in the same step.
+    Slot* slot = nullptr;
+    for (int i = 0; i < num_slots_ && slot == nullptr; ++i) {
+      Slot* candidate = GetSlot(i);
+      uint64_t expected = PackState(REQUEST, 0);
+      if (candidate->state.compare_exchange_strong(
+              expected, PackState(RUNNING, self))) {
+        slot = candidate;
+      }
+    }
+    if (slot == nullptr) {
+      // A post made on behalf of a dead worker.
+      continue;
+    }
+
+    size_t output_size = 0;
+    Invoker invoker = reinterpret_cast<Invoker>(slot->invoker);
+    slot->status = invoker(
+        reinterpret_cast<GenericFunction>(slot->function),
+        slot->input(),
+        slot->input_size,
+        slot->input() + slot_bytes_,
+        slot_bytes_,
+        &output_size);
+    slot->output_size = output_size;
+    slot->state = PackState(DONE, self);
+    sem_post(&slot->done);
+  }
+}
+
+bool RemoteExecutor::WorkerAlive(pid_t pid) const {
+  for (int i = 0; i < num_workers_; ++i) {
+    if (Workers()[i] == pid) {
+      // Dead workers are removed from the table by the supervisor. If the
+      // supervisor is gone, signalling tells whether the process still exists.
+      return kill(pid, 0) == 0;
+    }
+  }
+  return false;
+}
+
+bool RemoteExecutor::NoWorkersLeft() {
+  {
+    std::lock_guard<std::mutex> lock(supervisor_lock_);
+    if (!supervisor_died_ &&
+        waitpid(supervisor_pid_, nullptr, WNOHANG) == supervisor_pid_) {
+      std::cout << "[remote_executor] Supervisor " << supervisor_pid_
+                << " died" << std::endl;
+      supervisor_died_ = true;
+    }
+    if (!supervisor_died_) {
+      return false;
+    }
+  }
+  for (int i = 0; i < num_workers_; ++i) {
+    pid_t pid = Workers()[i];
+    if (pid != 0 && kill(pid, 0) == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::string RemoteExecutor::StatusMessage(CallStatus status) {
+  switch (status) {
+    case CallStatus::OK:
+      return "Remote call succeeded";
+    case CallStatus::PRODUCER_ERROR:
+      return "Remote producer produced an error";
+    case CallStatus::EXCEPTION:
+      return "Exception while running remote producer";
+    case CallStatus::INPUT_TOO_LARGE:
+      return "Inputs of remote producer don't fit into a slot";
+    case CallStatus::OUTPUT_TOO_LARGE:
+      return "Output of remote producer doesn't fit into a slot";
+    case CallStatus::WORKER_DIED:
+      return "Remote worker died";
+  }
+  return "Unknown remote call status";
+}
+
+}  // namespace ccproducers
@@ -0,0 +1,400 @@
+// Copyright 2016 Dino Wernli. All Rights Reserved. See LICENSE for licensing terms.
+
+#ifndef REMOTE_EXECUTOR_H_
+#define REMOTE_EXECUTOR_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "error.h"
+#include "input.h"
+#include "output.h"
+#include "serializer.h"
+
+namespace ccproducers {
+
+// Runs producers in forked worker processes, e.g., for crash isolation or to
+// keep large private heaps out of the serving process. Requests and responses
+// are passed through a ring of slots in shared memory. Values of zero copy
+// types are copied into the slots as-is and read by the worker in place, all
+// other types go through their Serializer.
+//
+// Workers run code of the same binary, so functions are identified by their
+// address. They are forked by a supervisor process, which itself is forked
+// from the process constructing the executor. An executor should thus be
+// constructed early, before the process starts threads whose state the
+// workers must not inherit.
+//
+// A call whose worker dies, e.g., because the producer crashed or the worker
+// got killed for its memory usage, fails with an error. The supervisor
+// replaces dead workers, so other calls are unaffected. Calls only fail
+// across the board if the supervisor itself is gone and no worker is left.
+// The supervisor dies with the process which constructed the executor, and
+// the workers die with the supervisor, so a crash never leaves them behind.
+class RemoteExecutor {
+ public:
+  // The outcome of a single remote call.
+  enum class CallStatus : int32_t {
+    OK,
+    PRODUCER_ERROR,
+    EXCEPTION,
+    INPUT_TOO_LARGE,
+    OUTPUT_TOO_LARGE,
+    WORKER_DIED,
+  };
+
+  typedef void (*GenericFunction)();
+
+  // Runs in a worker. Decodes the input, calls the function and encodes its
+  // output into the supplied buffer.
+  typedef CallStatus (*Invoker)(
+      GenericFunction function,
+      const char* input,
+      size_t input_size,
+      char* output,
+      size_t output_capacity,
+      size_t* output_size);
+
+  RemoteExecutor(int num_workers, int num_slots = 8, size_t slot_bytes = 1 << 20);
+  ~RemoteExecutor();
+
+  RemoteExecutor(const RemoteExecutor&) = delete;
+  RemoteExecutor& operator=(const RemoteExecutor&) = delete;
+
+  // Runs function through invoker in one of the workers. Blocks the calling
+  // thread until the call has completed. write_input is handed the input area
+  // of a slot and returns how many bytes it wrote, or -1 if they don't fit.
+  // read_output is called with the response before the slot is reused, if
+  // and only if the call succeeds or the producer produced an error. In the
+  // latter case, the response describes the error.
+  CallStatus Call(
+      Invoker invoker,
+      GenericFunction function,
+      const std::function<int64_t(char*, size_t)>& write_input,
+      const std::function<void(CallStatus, const char*, size_t)>& read_output);
+
+  // Returns the ids of the worker processes which are currently alive.
+  std::vector<pid_t> worker_pids() const;
+
+  // Returns how many workers have died, and have been replaced unless the
+  // executor is shutting down.
+  int64_t worker_deaths() const;
+
+  static std::string StatusMessage(CallStatus status);
+
+ private:
+  struct Header;
+  struct Slot;
+
+  Slot* GetSlot(int index) const;
+
+  // Returns the table of live workers, one entry per worker, each either
+  // holding the worker's pid or 0.
+  std::atomic<pid_t>* Workers() const;
+
+  // The main loop of the supervisor process. Forks the workers and replaces
+  // them as they die. Never returns.
+  void SupervisorLoop();
+
+  // Forks a worker which publishes its pid in the supplied table entry.
+  // Returns the pid, or -1 if the fork failed.
+  pid_t ForkWorker(int index);
+
+  // Wakes up forking_thread_ and waits for it to exit.
+  void StopForkingThread();
+
+  // The main loop of a worker process. Never returns.
+  void WorkerLoop();
+
+  // Returns whether the supplied worker is still alive.
+  bool WorkerAlive(pid_t pid) const;
+
+  // Returns whether no worker is alive and none will be forked anymore.
+  bool NoWorkersLeft();
+
+  int num_workers_;
+  int num_slots_;
+  size_t slot_bytes_;
+  size_t slot_stride_;
+
+  // The shared memory region, starting with a Header followed by the slots.
+  void* region_;
+  size_t region_size_;
+  Header* header_;
+
+  // The supervisor, a child of this process. Guarded by supervisor_lock_,
+  // which also serializes reaping it.
+  pid_t supervisor_pid_;
+  bool supervisor_died_;
+  std::mutex supervisor_lock_;
+
+  // The thread which forked the supervisor. It waits on stopped_ until
+  // stopping_ is set, since the supervisor dies along with it. Also guarded
+  // by supervisor_lock_.
+  std::thread forking_thread_;
+  bool stopping_;
+  std::condition_variable stopped_;
+};
+
+namespace internal {
+
+// Inputs are encoded one after the other, each as a RemoteValueHeader followed
+// by the value's bytes, padded so that every header and value is aligned.
+struct RemoteValueHeader {
+  uint32_t is_error;
+  uint32_t reserved;
+  uint64_t size;
+};
+
+const size_t kRemoteAlignment = alignof(std::max_align_t);
+
+inline size_t RemoteAlign(size_t offset) {
+  return (offset + kRemoteAlignment - 1) / kRemoteAlignment * kRemoteAlignment;
+}
+
+class RemoteWriter {
+ public:
+  RemoteWriter(char* buffer, size_t capacity)
+      : buffer_(buffer), capacity_(capacity), offset_(0), overflow_(false) {}
+
+  template<typename T>
+  bool Write(const Input<T>& input) {
+    if (input.IsError()) {
+      return Append(true, nullptr, 0);
+    }
+    return WriteValue(input.get(), IsZeroCopy<T>());
+  }
+
+  // Returns the number of bytes written, or -1 if they didn't fit.
+  int64_t Finish() const { return overflow_ ? -1 : static_cast<int64_t>(offset_); }
+
+ private:
+  template<typename T>
+  bool WriteValue(const T& value, std::true_type /* zero_copy */) {
+    return Append(false, reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+
+  template<typename T>
+  bool WriteValue(const T& value, std::false_type /* zero_copy */) {
+    std::string bytes = Serializer<T>::Serialize(value);
+    return Append(false, bytes.data(), bytes.size());
+  }
+
+  bool Append(bool is_error, const char* data, size_t size) {
+    size_t value_offset = offset_ + sizeof(RemoteValueHeader);
+    size_t end = RemoteAlign(value_offset + size);
+    if (overflow_ || end > capacity_) {
+      overflow_ = true;
+      return false;
+    }
+    RemoteValueHeader header{is_error ? 1u : 0u, 0, size};
+    std::memcpy(buffer_ + offset_, &header, sizeof(header));
+    if (size > 0) {
+      std::memcpy(buffer_ + value_offset, data, size);
+    }
+    offset_ = end;
+    return true;
+  }
+
+  char* buffer_;
+  size_t capacity_;
+  size_t offset_;
+  bool overflow_;
+};
+
+class RemoteReader {
+ public:
+  RemoteReader(const char* buffer, size_t size)
+      : buffer_(buffer), size_(size), offset_(0) {}
+
+  // Returns the next value, or nullptr if the value is an error. Zero copy
+  // values point straight into the buffer.
+  template<typename T>
+  std::shared_ptr<const T> Read() {
+    RemoteValueHeader header;
+    assert(offset_ + sizeof(header) <= size_);
+    std::memcpy(&header, buffer_ + offset_, sizeof(header));
+    assert(header.size <= size_ - offset_ - sizeof(header));
+    const char* data = buffer_ + offset_ + sizeof(header);
+    offset_ = RemoteAlign(offset_ + sizeof(header) + header.size);
+    if (header.is_error != 0) {
+      return nullptr;
+    }
+    return ReadValue<T>(data, header.size, IsZeroCopy<T>());
+  }
+
+ private:
+  template<typename T>
+  std::shared_ptr<const T> ReadValue(
+      const char* data, size_t size, std::true_type /* zero_copy */) {
+    assert(size == sizeof(T));
+    (void) size;
+    return std::shared_ptr<const T>(
+        reinterpret_cast<const T*>(data), [](const T*) {});
+  }
+
+  template<typename T>
+  std::shared_ptr<const T> ReadValue(
+      const char* data, size_t size, std::false_type /* zero_copy */) {
+    return std::make_shared<T>(Serializer<T>::Deserialize(data, size));
+  }
+
+  const char* buffer_;
+  size_t size_;
+  size_t offset_;
+};
+
+// Stands in for the error of a failed input within the worker. The actual
+// error stays in the calling process.
+inline const Error* RemoteInputError() {
+  static const Error* error = new Error(std::string("Input failed in caller"));
+  return error;
+}
+
+template<typename T>
+Input<T> MakeRemoteInput(const std::shared_ptr<const T>& value) {
+  if (value == nullptr) {
+    return Input<T>(RemoteInputError());
+  }
+  return Input<T>(value.get());
+}
+
+template<typename T>
+RemoteExecutor::CallStatus WriteRemoteOutput(
+    const T& value, char* output, size_t capacity, size_t* size,
+    std::true_type /* zero_copy */) {
+  if (sizeof(T) > capacity) {
+    return RemoteExecutor::CallStatus::OUTPUT_TOO_LARGE;
+  }
+  std::memcpy(output, &value, sizeof(T));
+  *size = sizeof(T);
+  return RemoteExecutor::CallStatus::OK;
+}
+
+template<typename T>
+RemoteExecutor::CallStatus WriteRemoteOutput(
+    const T& value, char* output, size_t capacity, size_t* size,
+    std::false_type /* zero_copy */) {
+  std::string bytes = Serializer<T>::Serialize(value);
+  if (bytes.size() > capacity) {
+    return RemoteExecutor::CallStatus::OUTPUT_TOO_LARGE;
+  }
+  std::memcpy(output, bytes.data(), bytes.size());
+  *size = bytes.size();
+  return RemoteExecutor::CallStatus::OK;
+}
+
+// The worker side of a remote producer with a specific signature.
+template<typename ReturnType, typename... Params>
+struct RemoteInvoker {
+  typedef Output<ReturnType> (*Function)(Input<Params>...);
+
+  static RemoteExecutor::CallStatus Invoke(
+      RemoteExecutor::GenericFunction function,
+      const char* input,
+      size_t input_size,
+      char* output,
+      size_t output_capacity,
+      size_t* output_size) {
+    return InvokeWithIndices(
+        reinterpret_cast<Function>(function), input, input_size, output,
+        output_capacity, output_size, std::index_sequence_for<Params...>());
+  }
+
+ private:
+  template<size_t... I>
+  static RemoteExecutor::CallStatus InvokeWithIndices(
+      Function function,
+      const char* input,
+      size_t input_size,
+      char* output,
+      size_t output_capacity,
+      size_t* output_size,
+      std::index_sequence<I...>) {
+    try {
+      // Braced initialization guarantees the inputs are read in order.
+      RemoteReader reader(input, input_size);
+      std::tuple<std::shared_ptr<const Params>...> values{
+          reader.Read<Params>()...};
+      Output<ReturnType> result =
+          function(MakeRemoteInput<Params>(std::get<I>(values))...);
+      if (result.IsError()) {
+        // The error is handed back as text, cut short if it doesn't fit.
+        std::string error = result.TakeError().ToString();
+        *output_size = std::min(error.size(), output_capacity);
+        std::memcpy(output, error.data(), *output_size);
+        return RemoteExecutor::CallStatus::PRODUCER_ERROR;
+      }
+      return WriteRemoteOutput(
+          result.get(), output, output_capacity, output_size,
+          IsZeroCopy<ReturnType>());
+    } catch (std::exception&) {
+      return RemoteExecutor::CallStatus::EXCEPTION;
+    }
+  }
+};
+
+}  // namespace internal
+
+// Wraps a producer so that every invocation runs in a worker of the supplied
+// executor. The result can be registered with a ProducerGraph like any other
+// producer, e.g.:
+//
+//   graph.AddProducer("isolated", RemoteProducer(&executor, &Produce), input);
+//
+// Inputs and the output must be zero copy or have a Serializer. The executor
+// must outlive all graphs using the returned producer.
+template<typename ReturnType, typename... Params>
+std::function<Output<ReturnType>(Input<Params>...)> RemoteProducer(
+    RemoteExecutor* executor, Output<ReturnType> (*f)(Input<Params>...)) {
+  auto function = reinterpret_cast<RemoteExecutor::GenericFunction>(f);
+  return [executor, function](Input<Params>... inputs) {
+    auto write_input = [&inputs...](char* buffer, size_t capacity) {
+      internal::RemoteWriter writer(buffer, capacity);
+      bool written[] = {true, writer.Write(inputs)...};
+      (void) written;
+      return writer.Finish();
+    };
+
+    std::shared_ptr<const ReturnType> value;
+    std::string error;
+    auto read_output = [&value, &error](
+        RemoteExecutor::CallStatus status, const char* data, size_t size) {
+      if (status == RemoteExecutor::CallStatus::PRODUCER_ERROR) {
+        error.assign(data, size);
+        return;
+      }
+      value = std::make_shared<ReturnType>(
+          Serializer<ReturnType>::Deserialize(data, size));
+    };
+
+    RemoteExecutor::CallStatus status = executor->Call(
+        &internal::RemoteInvoker<ReturnType, Params...>::Invoke,
+        function, write_input, read_output);
+    if (status == RemoteExecutor::CallStatus::PRODUCER_ERROR) {
+      return Output<ReturnType>(Error(error));
+    }
+    if (status != RemoteExecutor::CallStatus::OK) {
+      return Output<ReturnType>(Error(RemoteExecutor::StatusMessage(status)));
+    }
+    return Output<ReturnType>(std::move(value));
+  };
+}
+
+}  // namespace ccproducers
+
+#endif  // REMOTE_EXECUTOR_H
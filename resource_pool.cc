@@ -0,0 +1,94 @@
+// Copyright 2016 Dino Wernli. All Rights Reserved. See LICENSE for licensing terms.
+
+#include "resource_pool.h"
+
+#include <algorithm>
+#include <assert.h>
+
+namespace ccproducers {
+
+ResourcePool::ResourcePool(std::string name, int max_in_flight) :
+    name_(name), max_in_flight_(max_in_flight), next_ticket_(0), in_flight_(0),
+    max_queue_depth_(0), admitted_(0), deferred_(0), total_wait_(0),
+    max_wait_(0) {
+  assert(max_in_flight > 0);
+}
+
+ResourcePool::Ticket ResourcePool::Admit(std::function<void()> launch) {
+  Ticket ticket;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    ticket = next_ticket_++;
+    if (in_flight_ >= max_in_flight_) {
+      queue_.push_back(Pending{ticket, launch, Clock::now()});
+      ++deferred_;
+      max_queue_depth_ = std::max(max_queue_depth_, static_cast<int>(queue_.size()));
+      return ticket;
+    }
+    ++in_flight_;
+    ++admitted_;
+  }
+
+  // Launch outside the lock, the launched work may well call Release().
+  launch();
+  return ticket;
+}
+
+bool ResourcePool::Cancel(Ticket ticket) {
+  std::lock_guard<std::mutex> lock(lock_);
+  for (auto it = queue_.begin(); it != queue_.end(); ++it) {
+    if (it->ticket == ticket) {
+      queue_.erase(it);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ResourcePool::TryAcquire() {
+  std::lock_guard<std::mutex> lock(lock_);
+  if (in_flight_ >= max_in_flight_) {
+    return false;
+  }
+  ++in_flight_;
+  return true;
+}
+
+void ResourcePool::Release() {
+  std::function<void()> next;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    assert(in_flight_ > 0);
+    if (queue_.empty()) {
+      --in_flight_;
+      return;
+    }
+
+    // The capacity is handed over directly, so in_flight_ stays the same.
+    Pending pending = std::move(queue_.front());
+    queue_.pop_front();
+    ++admitted_;
+
+    auto wait = std::chrono::duration_cast<std::chrono::microseconds>(
+        Clock::now() - pending.enqueued);
+    total_wait_ += wait;
+    max_wait_ = std::max(max_wait_, wait);
+    next = std::move(pending.launch);
+  }
+  next();
+}
+
+ResourcePoolStats ResourcePool::Stats() const {
+  std::lock_guard<std::mutex> lock(lock_);
+  ResourcePoolStats stats;
+  stats.in_flight = in_flight_;
+  stats.queue_depth = static_cast<int>(queue_.size());
+  stats.max_queue_depth = max_queue_depth_;
+  stats.admitted = admitted_;
+  stats.deferred = deferred_;
+  stats.total_wait = total_wait_;
+  stats.max_wait = max_wait_;
+  return stats;
+}
+
+}  // namespace ccproducers
@@ -0,0 +1,102 @@
+// Copyright 2016 Dino Wernli. All Rights Reserved. See LICENSE for licensing terms.
+
+#ifndef RESOURCE_POOL_H_
+#define RESOURCE_POOL_H_
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+
+namespace ccproducers {
+
+// A snapshot of the counters kept by a resource pool.
+struct ResourcePoolStats {
+  // Number of nodes currently running in the pool.
+  int in_flight;
+
+  // Number of nodes which are ready but waiting for capacity.
+  int queue_depth;
+
+  // Largest queue depth observed so far.
+  int max_queue_depth;
+
+  // Total number of nodes admitted, and how many of those had to wait.
+  int64_t admitted;
+  int64_t deferred;
+
+  // Time spent waiting in the queue, summed over all deferred nodes and
+  // maximum over all deferred nodes.
+  std::chrono::microseconds total_wait;
+  std::chrono::microseconds max_wait;
+};
+
+// A named, capacity-limited pool which producers hitting a shared backend can
+// be tagged with. At most max_in_flight producers of the pool run at any time,
+// regardless of how many graphs they belong to. Nodes which become ready while
+// the pool is at capacity are queued without occupying a thread and are
+// launched once a running node of the pool finishes.
+//
+// Pools are usually shared between graphs and must outlive all graphs which
+// reference them.
+class ResourcePool {
+ public:
+  // Identifies a single call to Admit().
+  typedef uint64_t Ticket;
+
+  ResourcePool(std::string name, int max_in_flight);
+
+  const std::string& name() const { return name_; }
+  int max_in_flight() const { return max_in_flight_; }
+
+  // Calls launch right away if the pool has capacity. Otherwise, remembers it
+  // to be called by a later Release(). Never blocks. The supplied function
+  // must itself not block, i.e., it should only kick off the actual work.
+  // The returned ticket can be used to withdraw a launch which is queued.
+  Ticket Admit(std::function<void()> launch);
+
+  // Removes the launch with the supplied ticket from the queue. Returns true
+  // if the launch was still queued and will now never be called, false if it
+  // has already been called or is about to be.
+  bool Cancel(Ticket ticket);
+
+  // Takes one unit of capacity without queueing, e.g., for a duplicate of a
+  // node which already runs in the pool. Returns false if the pool is at
+  // capacity. Every successful call must be paired with a Release().
+  bool TryAcquire();
+
+  // Must be called exactly once for every admitted launch after the work has
+  // completed. Hands the capacity to the oldest queued entry, if any.
+  void Release();
+
+  ResourcePoolStats Stats() const;
+
+ private:
+  typedef std::chrono::steady_clock Clock;
+
+  struct Pending {
+    Ticket ticket;
+    std::function<void()> launch;
+    Clock::time_point enqueued;
+  };
+
+  std::string name_;
+  int max_in_flight_;
+
+  // All fields below are guarded by lock_.
+  mutable std::mutex lock_;
+  std::deque<Pending> queue_;
+  Ticket next_ticket_;
+  int in_flight_;
+  int max_queue_depth_;
+  int64_t admitted_;
+  int64_t deferred_;
+  std::chrono::microseconds total_wait_;
+  std::chrono::microseconds max_wait_;
+};
+
+}  // namespace ccproducers
+
+#endif  // RESOURCE_POOL_H
@@ -0,0 +1,47 @@
+// Copyright 2016 Dino Wernli. All Rights Reserved. See LICENSE for licensing terms.
+
+#ifndef SERIALIZER_H_
+#define SERIALIZER_H_
+
+#include <cassert>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+namespace ccproducers {
+
+// Whether values of type T can be used directly from raw bytes, i.e., without
+// running a serializer, as long as the bytes are suitably aligned.
+template<class T>
+struct IsZeroCopy : std::is_trivially_copyable<T> {};
+
+// Converts values of type T to and from bytes, for types which are not zero
+// copy. Specializations must provide:
+//
+//   static std::string Serialize(const T& value);
+//   static T Deserialize(const char* data, size_t size);
+//
+// The primary template is deliberately left undefined so that using a type
+// without a serializer fails at compile time.
+template<class T, class Enable = void>
+struct Serializer;
+
+// Zero copy types are serialized as their object representation.
+template<class T>
+struct Serializer<T, typename std::enable_if<IsZeroCopy<T>::value>::type> {
+  static std::string Serialize(const T& value) {
+    return std::string(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+
+  static T Deserialize(const char* data, size_t size) {
+    assert(size == sizeof(T));
+    (void) size;
+    T result;
+    std::memcpy(&result, data, sizeof(T));
+    return result;
+  }
+};
+
+}  // namespace ccproducers
+
+#endif  // SERIALIZER_H
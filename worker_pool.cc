@@ -0,0 +1,198 @@
+// Copyright 2016 Dino Wernli. All Rights Reserved. See LICENSE for licensing terms.
+
+#include "worker_pool.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <iostream>
+#include <iterator>
+#include <pthread.h>
+#include <sched.h>
+
+namespace {
+
+// How long a task must have been queued on its worker before other workers
+// may steal it.
+const std::chrono::microseconds kStealDelay(100);
+
+// The pool and index of the worker running on the current thread, if any.
+thread_local const ccproducers::WorkerPool* current_pool = nullptr;
+thread_local int current_worker = -1;
+
+// Restricts the calling thread to the supplied cores. Failing to do so only
+// costs locality, so it is logged rather than treated as an error.
+void PinCurrentThread(const std::vector<int>& cores) {
+  if (cores.empty()) {
+    return;
+  }
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  for (int core : cores) {
+    CPU_SET(core, &cpu_set);
+  }
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) != 0) {
+    std::cout << "[worker_pool] Unable to pin worker to "
+              << cores.size() << " core(s)" << std::endl;
+  }
+}
+
+}  // namespace
+
+namespace ccproducers {
+
+WorkerPool::WorkerPool(std::vector<std::vector<int>> core_groups) :
+    next_worker_(0), metrics_(nullptr), tasks_(0), steals_(0), shutdown_(false) {
+  assert(!core_groups.empty());
+  for (const auto& cores : core_groups) {
+    workers_.push_back(std::make_unique<Worker>());
+    workers_.back()->cores = cores;
+  }
+
+  // Only start threads once all workers exist, since they steal from each
+  // other.
+  for (int i = 0; i < size(); ++i) {
+    workers_[i]->thread = std::thread(&WorkerPool::WorkerLoop, this, i);
+  }
+}
+
+WorkerPool::WorkerPool(int num_workers) :
+    WorkerPool(DefaultCoreGroups(num_workers)) {}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(wake_lock_);
+    shutdown_ = true;
+  }
+  wake_.notify_all();
+  for (const auto& worker : workers_) {
+    worker->thread.join();
+  }
+}
+
+std::vector<std::vector<int>> WorkerPool::DefaultCoreGroups(int num_workers) {
+  int num_cores = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<std::vector<int>> result;
+  for (int i = 0; i < num_workers; ++i) {
+    result.push_back({i % num_cores});
+  }
+  return result;
+}
+
+int WorkerPool::CurrentWorker() {
+  return current_worker;
+}
+
+void WorkerPool::Submit(int worker, bool pinned, std::function<void()> task) {
+  assert(!pinned || (worker >= 0 && worker < size()));
+  if (worker < 0 || worker >= size()) {
+    // Without a worker of its own, a task must not be tied to whichever
+    // worker it ends up on.
+    pinned = false;
+    if (current_pool == this) {
+      worker = current_worker;
+    } else {
+      worker = next_worker_++ % size();
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(workers_[worker]->lock);
+    workers_[worker]->queue.push_back(Task{std::move(task), pinned, std::chrono::steady_clock::now()});
+  }
+
+  // Taking the lock makes sure no worker is between checking for work and
+  // going to sleep. All workers are woken since any of them may steal.
+  { std::lock_guard<std::mutex> lock(wake_lock_); }
+  wake_.notify_all();
+}
+
+WorkerPoolStats WorkerPool::Stats() const {
+  WorkerPoolStats stats;
+  stats.tasks = tasks_;
+  stats.steals = steals_;
+  return stats;
+}
+
+void WorkerPool::WorkerLoop(int index) {
+  current_pool = this;
+  current_worker = index;
+  PinCurrentThread(workers_[index]->cores);
+
+  while (true) {
+    Task task;
+    if (PopLocal(index, &task) || Steal(index, &task)) {
+      ++tasks_;
+      task.run();
+      continue;
+    }
+
+    // Tasks of other workers which are too young to steal only make this
+    // worker look again after the steal delay.
+    std::unique_lock<std::mutex> lock(wake_lock_);
+    if (HasStealableWork(index)) {
+      wake_.wait_for(lock, kStealDelay, [this, index]() {
+        return HasLocalWork(index);
+      });
+    } else {
+      wake_.wait(lock, [this, index]() {
+        return shutdown_ || HasLocalWork(index) || HasStealableWork(index);
+      });
+      if (shutdown_ && !HasLocalWork(index) && !HasStealableWork(index)) {
+        return;
+      }
+    }
+  }
+}
+
+bool WorkerPool::PopLocal(int index, Task* task) {
+  Worker* worker = workers_[index].get();
+  std::lock_guard<std::mutex> lock(worker->lock);
+  if (worker->queue.empty()) {
+    return false;
+  }
+  *task = std::move(worker->queue.front());
+  worker->queue.pop_front();
+  return true;
+}
+
+bool WorkerPool::Steal(int index, Task* task) {
+  auto cutoff = std::chrono::steady_clock::now() - kStealDelay;
+  for (int i = 1; i < size(); ++i) {
+    Worker* victim = workers_[(index + i) % size()].get();
+    std::lock_guard<std::mutex> lock(victim->lock);
+    for (auto it = victim->queue.rbegin(); it != victim->queue.rend(); ++it) {
+      if (!it->pinned && it->queued <= cutoff) {
+        *task = std::move(*it);
+        victim->queue.erase(std::next(it).base());
+        ++steals_;
+        ExecutorMetrics* metrics = metrics_;
+        if (metrics != nullptr) {
+          metrics->RecordSteal();
+        }
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+bool WorkerPool::HasLocalWork(int index) {
+  Worker* worker = workers_[index].get();
+  std::lock_guard<std::mutex> lock(worker->lock);
+  return !worker->queue.empty();
+}
+
+bool WorkerPool::HasStealableWork(int index) {
+  for (int i = 1; i < size(); ++i) {
+    Worker* worker = workers_[(index + i) % size()].get();
+    std::lock_guard<std::mutex> lock(worker->lock);
+    for (const Task& task : worker->queue) {
+      if (!task.pinned) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+}  // namespace ccproducers
@@ -0,0 +1,134 @@
+// Copyright 2016 Dino Wernli. All Rights Reserved. See LICENSE for licensing terms.
+
+#ifndef WORKER_POOL_H_
+#define WORKER_POOL_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "metrics.h"
+
+namespace ccproducers {
+
+// A snapshot of the counters kept by a worker pool.
+struct WorkerPoolStats {
+  // Total number of tasks run by the pool.
+  int64_t tasks;
+
+  // Number of tasks run by a worker other than the one they were queued for.
+  int64_t steals;
+};
+
+// Counts how many nodes of a graph ran on the worker they were placed on,
+// i.e., next to their largest input or on their pinned worker. Nodes placed
+// without a preference are not counted.
+struct LocalityStats {
+  int64_t hits;
+  int64_t misses;
+
+  double HitRate() const {
+    return hits + misses == 0 ? 0.0 : static_cast<double>(hits) / (hits + misses);
+  }
+};
+
+// A fixed set of worker threads, each pinned to a group of cores, which nodes
+// can run on instead of getting a fresh thread each. Every worker has its own
+// queue, so a task can be placed on a specific worker, e.g., the one whose
+// cache holds the task's inputs. Idle workers steal tasks which have been
+// queued on another worker for a short while, unless the task is pinned to
+// its worker. The delay gives a worker which queues a task for itself the
+// chance to finish what it is doing and pick the task up while its caches
+// are still warm.
+//
+// Pools may be shared between graphs and must outlive all graphs using them.
+class WorkerPool {
+ public:
+  // Creates one worker per entry, pinned to the cores of that entry. Workers
+  // with an empty entry are not pinned.
+  WorkerPool(std::vector<std::vector<int>> core_groups);
+
+  // Creates num_workers workers, pinning worker i to core i modulo the
+  // number of cores.
+  WorkerPool(int num_workers);
+
+  // Runs all queued tasks, then stops the workers.
+  ~WorkerPool();
+
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+
+  int size() const { return static_cast<int>(workers_.size()); }
+
+  // Queues a task for the supplied worker. If worker is negative, the task is
+  // queued for the calling worker if called from a worker of this pool, and
+  // round-robin otherwise. Pinned tasks only ever run on their worker, which
+  // must be one of this pool. Never blocks on running tasks.
+  void Submit(int worker, bool pinned, std::function<void()> task);
+
+  // Returns the index of the worker running the calling thread, or -1 if the
+  // calling thread is not a worker of any pool.
+  static int CurrentWorker();
+
+  // Makes the pool count steals in the supplied metrics.
+  void SetMetrics(ExecutorMetrics* metrics) { metrics_ = metrics; }
+
+  WorkerPoolStats Stats() const;
+
+ private:
+  struct Task {
+    std::function<void()> run;
+    bool pinned;
+    std::chrono::steady_clock::time_point queued;
+  };
+
+  struct Worker {
+    std::vector<int> cores;
+    std::thread thread;
+
+    // Tasks queued for this worker, guarded by lock.
+    std::mutex lock;
+    std::deque<Task> queue;
+  };
+
+  static std::vector<std::vector<int>> DefaultCoreGroups(int num_workers);
+
+  void WorkerLoop(int index);
+
+  // Takes the oldest task queued for the supplied worker.
+  bool PopLocal(int index, Task* task);
+
+  // Takes the newest unpinned task queued for any other worker for at least
+  // the steal delay.
+  bool Steal(int index, Task* task);
+
+  // Whether there is a task queued for the supplied worker.
+  bool HasLocalWork(int index);
+
+  // Whether there is an unpinned task queued for any other worker, no matter
+  // for how long.
+  bool HasStealableWork(int index);
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::atomic<uint32_t> next_worker_;
+  std::atomic<ExecutorMetrics*> metrics_;
+
+  std::atomic<int64_t> tasks_;
+  std::atomic<int64_t> steals_;
+
+  // Idle workers wait on wake_ until there is work or shutdown_ is set.
+  std::mutex wake_lock_;
+  std::condition_variable wake_;
+  bool shutdown_;
+};
+
+}  // namespace ccproducers
+
+#endif  // WORKER_POOL_H